@@ -0,0 +1,62 @@
+/*
+ * Parser benchmark: parses a file several times and reports the time per parse and the number of
+ * C++ exceptions thrown while parsing (counted by interposing __cxa_throw).
+ *
+ * Usage: vpl_parse_bench <file> [repetitions]
+ */
+#include <vpl_grammar.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <typeinfo>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+
+namespace {
+
+std::size_t throw_count = 0;
+
+}  /* namespace */
+
+namespace __cxxabiv1 {
+
+extern "C" void __cxa_throw(void* exception, std::type_info* type, void (*destructor)(void*)) {
+    using ThrowFunc = void (*)(void*, std::type_info*, void (*)(void*));
+    static ThrowFunc real_throw = reinterpret_cast<ThrowFunc>(dlsym(RTLD_NEXT, "__cxa_throw"));
+    ++throw_count;
+    real_throw(exception, type, destructor);
+    std::abort();
+}
+
+}  /* namespace __cxxabiv1 */
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <file> [repetitions]\n";
+        return 1;
+    }
+    std::ifstream fin(argv[1]);
+    std::string source((std::istreambuf_iterator<char>(fin)), (std::istreambuf_iterator<char>()));
+    int repetitions = argc > 2 ? std::atoi(argv[2]) : 10;
+
+    VPLGrammar::Parser parser;
+    std::size_t failures = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; ++i) {
+        try {
+            parser.Parse(source);
+        } catch (std::exception&) {
+            ++failures;
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "file:                 " << argv[1] << " (" << source.size() << " bytes)\n";
+    std::cout << "parses:               " << repetitions << " (" << failures << " failed)\n";
+    std::cout << "time per parse:       " << elapsed.count() / repetitions << " ms\n";
+    std::cout << "exceptions per parse: " << static_cast<double>(throw_count) / repetitions << '\n';
+    return 0;
+}
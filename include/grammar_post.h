@@ -21,9 +21,18 @@
 #undef DEFTOKENS
 #undef ENDTOKENS
 #undef DEFTOKEN
+#undef DEFKEYWORD
+#undef DEFLEXEME
+#undef DEFSYMBOL
 #undef ENDTOKEN
 #undef MAINRULE
 #undef RULE
 #undef TOKEN
 #undef DEFNODE
 #undef ENDNODE
+#undef PROFILE_MEMBERS
+#undef PROFILE_RULE
+#undef PROFILE_MEMO_HIT
+#undef BINARYOPERATORS
+#undef OPERAND
+#undef UNWRAP
@@ -1,41 +1,40 @@
 #include <vector>
+#include <algorithm>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <string_view>
 #include <string>
-#include <regex>
 #include <iostream>
+#include <cstdint>
+#include <unordered_map>
+#include <initializer_list>
+#include <stdexcept>
 
+#include "lexer.h"
+#include "node_list.h"
+#include "parse_profile.h"
+#include "symbol_table.h"
 
 
-class Logger {
-public:
-    explicit Logger(const char* name) : name_(name) {
-        Indent();
-        ++depth_;
-        std::cerr << "ENTER: " << name << std::endl;
-    }
-    ~Logger() {
-        --depth_;
-        Indent();
-        if (std::uncaught_exceptions() > 0) {
-            std::cerr << "FAIL: ";
-        } else {
-            std::cerr << "SUCCESS: ";
-        }
-        std::cerr << name_ << std::endl;
-    }
-private:
-    void Indent() const {
-        for (int i = 0; i < depth_; ++i) {
-            std::cerr << ' ';
-        }
-    }
-
-    const char* name_;
-    static int depth_;
-};
 
-// TO_DO REMOVE NAFIG
-int Logger::depth_ = 0;
+#ifdef PARSE_PROFILE
+#define PROFILE_MEMBERS                                                                             \
+    ParseProfile profile_;                                                                          \
+                                                                                                    \
+public:                                                                                             \
+    const ParseProfile& GetProfile() const {                                                        \
+        return profile_;                                                                            \
+    }                                                                                               \
+                                                                                                    \
+private:
+#define PROFILE_RULE(name) ParseProfile::Scope profile_scope(&profile_, k##name##Type, #name, pos_, failed_);
+#define PROFILE_MEMO_HIT(type) ++profile_.Get(type, nullptr).memo_hits;
+#else
+#define PROFILE_MEMBERS
+#define PROFILE_RULE(name)
+#define PROFILE_MEMO_HIT(type)
+#endif
 
 #define DEFGRAMMAR(name) namespace name##Grammar {
 
@@ -43,23 +42,18 @@ int Logger::depth_ = 0;
 
 
 #define DEFBASICNODE()                                                                              \
+/*                                                                                                  \
+ * Nodes live in the arena of the Parser that built them and are never destroyed one by one: the    \
+ * whole tree is released by the next Parse() or by the parser's destructor. Token nodes refer to   \
+ * the parsed source.                                                                               \
+ */                                                                                                 \
 class ASTNodeBasic {                                                                                \
 public:                                                                                             \
-    using NodePtr = std::unique_ptr<ASTNodeBasic>;                                                  \
-                                                                                                    \
-    void Tx() { txs_.push_back(children_.size()); }                                                 \
-                                                                                                    \
-    void Rollback() { children_.resize(txs_.back()); txs_.pop_back(); }                             \
+    using NodePtr = ASTNodeBasic*;                                                                  \
                                                                                                     \
-    void Commit() {txs_.pop_back(); }                                                               \
+    explicit ASTNodeBasic(NodeList<NodePtr> children) : children_(children) {}                      \
                                                                                                     \
-    auto& GetChildren() { return children_; }                                                       \
-                                                                                                    \
-    const auto& GetChildren() const { return children_; }                                           \
-                                                                                                    \
-    void Append(NodePtr&& node) {                                                                   \
-        children_.emplace_back(std::move(node));                                                    \
-    }                                                                                               \
+    const NodeList<NodePtr>& GetChildren() const { return children_; }                              \
                                                                                                     \
     virtual ~ASTNodeBasic() = default;                                                              \
                                                                                                     \
@@ -68,8 +62,7 @@ public:
     virtual const char* GetName() const = 0;                                                        \
                                                                                                     \
 protected:                                                                                          \
-    std::vector<NodePtr> children_;                                                                 \
-    std::vector<std::size_t> txs_;                                                                  \
+    NodeList<NodePtr> children_;                                                                    \
 
 
 
@@ -83,15 +76,288 @@ public:
 };                                                                                                  \
                                                                                                     \
 class Parser {                                                                                      \
-    using NodePtr = std::unique_ptr<ASTNodeBasic>;
+    using NodePtr = ASTNodeBasic*;                                                                  \
+                                                                                                    \
+    /* Outcome of a rule at a token position: the subtree and where it ended, or null on failure */ \
+    struct MemoEntry {                                                                              \
+        NodePtr node;                                                                               \
+        std::size_t end_pos;                                                                        \
+    };                                                                                              \
+                                                                                                    \
+    using RuleParser = NodePtr (Parser::*)();                                                       \
+                                                                                                    \
+    /*                                                                                              \
+     * Tokens a rule can start with, and whether it can match no tokens at all. `states` are the    \
+     * lexer states accepted by any of the tokens, indexed like Lexer::Token::kind.                 \
+     */                                                                                             \
+    struct FirstSet {                                                                               \
+        bool is_computed = false;                                                                   \
+        bool is_computing = false;                                                                  \
+        bool is_nullable = false;                                                                   \
+        std::vector<int> tokens;                                                                    \
+        std::vector<bool> states;                                                                   \
+    };                                                                                              \
+                                                                                                    \
+    /* Entry of the binary operator table, indexed by the operator's token type */                  \
+    struct BinaryOperator {                                                                         \
+        int level = 0;                                                                              \
+        bool keeps_token = false;                                                                   \
+        NodePtr (*make_node)(Parser*, std::size_t) = nullptr;                                       \
+    };                                                                                              \
+                                                                                                    \
+    Lexer lexer_;                                                                                   \
+    std::pmr::monotonic_buffer_resource arena_;                                                     \
+    std::vector<NodePtr> scratch_;                                                                  \
+    SymbolTable symbols_;                                                                           \
+    PROFILE_MEMBERS                                                                                 \
+    std::vector<RuleParser> token_parsers_;                                                         \
+    std::vector<const char*> token_names_;                                                          \
+    std::vector<FirstSet> first_sets_;                                                              \
+    std::vector<int>* first_tokens_ = nullptr;                                                      \
+    std::vector<BinaryOperator> operators_;                                                         \
+    std::vector<int> operator_of_state_;                                                            \
+    std::unordered_map<std::uint64_t, MemoEntry> memo_;                                             \
+    bool is_memo_enabled_ = false;                                                                  \
+    std::size_t memo_threshold_ = 1024;                                                             \
+                                                                                                    \
+public:                                                                                             \
+    /* Memoization pays off on large inputs only; it is enabled from this many tokens on */        \
+    void SetMemoThreshold(std::size_t min_tokens) {                                                 \
+        memo_threshold_ = min_tokens;                                                               \
+    }                                                                                               \
+                                                                                                    \
+    /* Names of the DEFSYMBOL tokens of the last parse */                                           \
+    const SymbolTable& GetSymbols() const {                                                         \
+        return symbols_;                                                                            \
+    }                                                                                               \
+                                                                                                    \
+private:                                                                                            \
+    template <class Body>                                                                           \
+    NodePtr Memoize(int type, Body body) {                                                          \
+        if (!is_memo_enabled_) {                                                                    \
+            return (this->*body)();                                                                 \
+        }                                                                                           \
+        std::uint64_t key = (static_cast<std::uint64_t>(pos_) << 32) | type;                        \
+        auto iter = memo_.find(key);                                                                \
+        if (iter != memo_.end()) {                                                                  \
+            PROFILE_MEMO_HIT(type)                                                                  \
+            if (!iter->second.node) {                                                               \
+                failed_ = true;                                                                     \
+                return nullptr;                                                                     \
+            }                                                                                       \
+            pos_ = iter->second.end_pos;                                                            \
+            return iter->second.node;                                                               \
+        }                                                                                           \
+        NodePtr node = (this->*body)();                                                             \
+        memo_.emplace(key, MemoEntry{node, pos_});                                                  \
+        return node;                                                                                \
+    }                                                                                               \
+                                                                                                    \
+    bool AddToken(int type, const char* name, const char* regexp, bool is_keyword,                  \
+                  RuleParser parser) {                                                              \
+        if (type >= static_cast<int>(token_parsers_.size())) {                                      \
+            token_parsers_.resize(type + 1);                                                        \
+            token_names_.resize(type + 1);                                                          \
+        }                                                                                           \
+        token_parsers_[type] = parser;                                                              \
+        token_names_[type] = name;                                                                  \
+        return lexer_.AddToken(type, regexp, is_keyword);                                           \
+    }                                                                                               \
+                                                                                                    \
+    bool AddOperators(int level, bool keeps_token, NodePtr (*make_node)(Parser*, std::size_t),      \
+                      std::initializer_list<int> types) {                                           \
+        for (int type : types) {                                                                    \
+            if (type >= static_cast<int>(operators_.size())) {                                      \
+                operators_.resize(type + 1);                                                        \
+            }                                                                                       \
+            operators_[type] = {level, keeps_token, make_node};                                     \
+        }                                                                                           \
+        operator_of_state_.clear();                                                                 \
+        return true;                                                                                \
+    }                                                                                               \
+                                                                                                    \
+    /* Maps every lexer state to the operator token it accepts, or -1 */                            \
+    void BuildOperatorTable() {                                                                     \
+        if (!operator_of_state_.empty()) {                                                          \
+            return;                                                                                 \
+        }                                                                                           \
+        operator_of_state_.assign(lexer_.StateCount(), -1);                                         \
+        for (std::size_t state = 0; state < operator_of_state_.size(); ++state) {                   \
+            for (std::size_t type = 0; type < operators_.size(); ++type) {                          \
+                if (operators_[type].level > 0 && lexer_.Accepts(state, type)) {                    \
+                    operator_of_state_[state] = type;                                               \
+                }                                                                                   \
+            }                                                                                       \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    int PeekOperator() const {                                                                      \
+        int state = tokens_[pos_].kind;                                                             \
+        return state == Lexer::kDeadState ? -1 : operator_of_state_[state];                         \
+    }                                                                                               \
+                                                                                                    \
+    /*                                                                                              \
+     * Precedence climbing over the BINARYOPERATORS table: an operand followed by any operators of  \
+     * `min_level` or tighter. Operators of one level are left-associative and share a single node, \
+     * e.g. `a - b + c` is one AdditiveExpression [a, -, b, +, c]. An operand that is not followed  \
+     * by such an operator is returned as is, without any wrapping nodes.                           \
+     */                                                                                             \
+    NodePtr ParseOperators(int min_level) {                                                         \
+        NodePtr lhs = ParseOperand();                                                               \
+        while (!failed_) {                                                                          \
+            int type = PeekOperator();                                                              \
+            if (type == -1 || operators_[type].level < min_level) {                                 \
+                break;                                                                              \
+            }                                                                                       \
+            int level = operators_[type].level;                                                     \
+            NodePtr (*make_node)(Parser*, std::size_t) = operators_[type].make_node;                \
+            std::size_t frame = scratch_.size();                                                    \
+            scratch_.push_back(lhs);                                                                \
+            while (type != -1 && operators_[type].level == level) {                                 \
+                NodePtr token = (this->*token_parsers_[type])();                                    \
+                if (operators_[type].keeps_token) {                                                 \
+                    scratch_.push_back(token);                                                      \
+                }                                                                                   \
+                NodePtr rhs = ParseOperators(level + 1);                                            \
+                if (failed_) {                                                                      \
+                    scratch_.resize(frame);                                                         \
+                    return nullptr;                                                                 \
+                }                                                                                   \
+                scratch_.push_back(rhs);                                                            \
+                type = PeekOperator();                                                              \
+            }                                                                                       \
+            lhs = make_node(this, frame);                                                           \
+        }                                                                                           \
+        return failed_ ? nullptr : lhs;                                                             \
+    }                                                                                               \
+                                                                                                    \
+    template <class Node, class... Args>                                                            \
+    Node* New(Args&&... args) {                                                                     \
+        void* memory = arena_.allocate(sizeof(Node), alignof(Node));                                \
+        return new (memory) Node(std::forward<Args>(args)...);                                      \
+    }                                                                                               \
+                                                                                                    \
+    /* Creates a rule's node from the children collected on the scratch stack since `frame` */      \
+    template <class Node>                                                                           \
+    NodePtr Finish(std::size_t frame) {                                                             \
+        std::size_t count = scratch_.size() - frame;                                                \
+        NodePtr* children = nullptr;                                                                \
+        if (count > 0) {                                                                            \
+            void* memory = arena_.allocate(count * sizeof(NodePtr), alignof(NodePtr));              \
+            children = static_cast<NodePtr*>(memory);                                               \
+            std::copy(scratch_.begin() + frame, scratch_.end(), children);                          \
+            scratch_.resize(frame);                                                                 \
+        }                                                                                           \
+        return New<Node>(NodeList<NodePtr>(children, count));                                       \
+    }                                                                                               \
+                                                                                                    \
+    /*                                                                                              \
+     * FIRST sets are found by running a rule body once in "first mode" (first_tokens_ is set):     \
+     * a token appends its type to first_tokens_ and fails instead of matching, a rule appends its  \
+     * own FIRST set and fails unless it is nullable. So a sequence stops at its first element that \
+     * must consume a token, and OR, ASTERISK and MAYBE go on to try every alternative.             \
+     */                                                                                             \
+    const FirstSet& GetFirstSet(int type, RuleParser body) {                                        \
+        if (type >= static_cast<int>(first_sets_.size())) {                                         \
+            first_sets_.resize(type + 1);                                                           \
+        }                                                                                           \
+        if (first_sets_[type].is_computed) {                                                        \
+            return first_sets_[type];                                                               \
+        }                                                                                           \
+        if (first_sets_[type].is_computing) {                                                       \
+            throw std::logic_error("Left recursion in grammar rule #" + std::to_string(type));      \
+        }                                                                                           \
+        first_sets_[type].is_computing = true;                                                      \
+                                                                                                    \
+        std::vector<int> tokens;                                                                    \
+        std::vector<int>* outer_tokens = first_tokens_;                                             \
+        bool outer_failed = failed_;                                                                \
+        first_tokens_ = &tokens;                                                                    \
+        failed_ = false;                                                                            \
+        bool is_nullable = (this->*body)() != nullptr;                                              \
+        first_tokens_ = outer_tokens;                                                               \
+        failed_ = outer_failed;                                                                     \
+                                                                                                    \
+        FirstSet& first = first_sets_[type];                                                        \
+        first.is_nullable = is_nullable;                                                            \
+        first.states.assign(lexer_.StateCount(), false);                                            \
+        for (std::size_t state = 0; state < first.states.size(); ++state) {                         \
+            for (int token : tokens) {                                                              \
+                if (lexer_.Accepts(state, token)) {                                                 \
+                    first.states[state] = true;                                                     \
+                }                                                                                   \
+            }                                                                                       \
+        }                                                                                           \
+        std::sort(tokens.begin(), tokens.end());                                                    \
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());                      \
+        first.tokens = std::move(tokens);                                                           \
+        first.is_computing = false;                                                                 \
+        first.is_computed = true;                                                                   \
+        return first;                                                                               \
+    }                                                                                               \
+                                                                                                    \
+    /* First mode counterpart of a rule call; returns whether the rule is nullable */               \
+    bool AddFirstSet(int type, RuleParser body) {                                                   \
+        const FirstSet& first = GetFirstSet(type, body);                                            \
+        first_tokens_->insert(first_tokens_->end(), first.tokens.begin(), first.tokens.end());      \
+        failed_ = !first.is_nullable;                                                               \
+        return first.is_nullable;                                                                   \
+    }                                                                                               \
+                                                                                                    \
+    /* Rejects a rule up front if the current token cannot start it */                              \
+    bool Predicts(int type, RuleParser body) {                                                      \
+        bool is_computed = type < static_cast<int>(first_sets_.size())                              \
+            && first_sets_[type].is_computed;                                                       \
+        const FirstSet& first = is_computed ? first_sets_[type] : GetFirstSet(type, body);          \
+        int state = tokens_[pos_].kind;                                                             \
+        if (first.is_nullable || (state != Lexer::kDeadState && first.states[state])) {             \
+            return true;                                                                            \
+        }                                                                                           \
+        for (int token : first.tokens) {                                                            \
+            Fail(token_names_[token]);                                                              \
+        }                                                                                           \
+        return false;                                                                               \
+    }                                                                                               \
+                                                                                                    \
+    /*                                                                                              \
+     * Marks the current alternative as failed. Everything up to the enclosing OR/ASTERISK/MAYBE    \
+     * is then skipped, and that combinator clears the flag when it backtracks. The furthest        \
+     * position any token was expected at is kept for the error reported by Parse().               \
+     */                                                                                             \
+    void Fail(const char* expected) {                                                               \
+        failed_ = true;                                                                             \
+        if (pos_ > furthest_pos_) {                                                                 \
+            furthest_pos_ = pos_;                                                                   \
+            expected_.clear();                                                                      \
+        }                                                                                           \
+        if (pos_ == furthest_pos_ &&                                                                \
+                std::find(expected_.begin(), expected_.end(), expected) == expected_.end()) {       \
+            expected_.push_back(expected);                                                          \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    std::string FailureMessage() const {                                                            \
+        std::string what = "Bad token at pos ";                                                     \
+        what += std::to_string(tokens_[furthest_pos_].offset);                                      \
+        what += ", expected ";                                                                      \
+        for (std::size_t i = 0; i < expected_.size(); ++i) {                                        \
+            what += i == 0 ? "" : " or ";                                                           \
+            what += expected_[i];                                                                   \
+        }                                                                                           \
+        return what;                                                                                \
+    }
 
 
 
 
 #define ENDGRAMMAR(name)                                                                            \
     private:                                                                                        \
-        const std::string* str_;                                                                    \
-        std::string::const_iterator pos_;                                                           \
+        std::string_view str_;                                                                      \
+        std::vector<Lexer::Token> tokens_;                                                          \
+        std::size_t pos_;                                                                           \
+        bool failed_;                                                                               \
+        std::size_t furthest_pos_;                                                                  \
+        std::vector<const char*> expected_;                                                         \
 };                                                                                                  \
 } /* namespace */
 
@@ -103,6 +369,8 @@ public:
     static constexpr int k##name##Type = __COUNTER__;                                               \
     class name##Node : public ASTNodeBasic {                                                        \
     public:                                                                                         \
+        using ASTNodeBasic::ASTNodeBasic;                                                           \
+                                                                                                    \
         virtual int GetType() const override { return k##name##Type; }                              \
         virtual const char* GetName() const override { return #name ; }
 
@@ -113,46 +381,108 @@ public:
     };                                                                                              \
 private:                                                                                            \
     NodePtr Parse##name() {                                                                         \
-        Logger logger(__PRETTY_FUNCTION__); /**/                                                   \
-        NodePtr result = std::make_unique< name##Node >();
+        if (failed_) {                                                                              \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        if (first_tokens_) {                                                                        \
+            return AddFirstSet(k##name##Type, &Parser::Parse##name##Body)                           \
+                ? New< name##Node >(NodeList<NodePtr>()) : nullptr;                                 \
+        }                                                                                           \
+        PROFILE_RULE(name)                                                                          \
+        if (!Predicts(k##name##Type, &Parser::Parse##name##Body)) {                                 \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        return Memoize(k##name##Type, &Parser::Parse##name##Body);                                  \
+    }                                                                                               \
+                                                                                                    \
+    NodePtr Parse##name##Body() {                                                                   \
+        using ResultNode = name##Node;                                                              \
+        std::size_t frame = scratch_.size();
 
 
 
 
 #define ENDRULE(name)                                                                               \
-        return result;                                                                              \
+        if (failed_) {                                                                              \
+            scratch_.resize(frame);                                                                 \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        return Finish<ResultNode>(frame);                                                           \
     }
 
 
 
 
+/*
+ * Registers the binary operators of one precedence level; a higher level binds tighter. The rule's
+ * node collects the operands of a chain and, if `keeps_token`, the operator tokens between them.
+ * Parse##name() parses operators of this level and tighter, like the rule cascade it replaces.
+ */
+#define BINARYOPERATORS(name, level, keeps_token, ...)                                              \
+    };                                                                                              \
+private:                                                                                            \
+    bool Registered##name {AddOperators(level, keeps_token,                                         \
+        [] (Parser* parser, std::size_t frame) { return parser->Finish< name##Node >(frame); },     \
+        {__VA_ARGS__})};                                                                            \
+                                                                                                    \
+    NodePtr Parse##name() {                                                                         \
+        if (failed_) {                                                                              \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        PROFILE_RULE(name)                                                                          \
+        return ParseOperators(level);                                                               \
+    }
+
+/* The rule that parses the operands of BINARYOPERATORS */
+#define OPERAND(name)                                                                               \
+private:                                                                                            \
+    NodePtr ParseOperand() {                                                                        \
+        return Parse##name();                                                                       \
+    }
+
+
+
+
+/* A rule that only wraps a single child yields the child itself */
+#define UNWRAP()                                                                                    \
+if (!failed_ && scratch_.size() == frame + 1) {                                                     \
+    NodePtr child = scratch_.back();                                                                \
+    scratch_.pop_back();                                                                            \
+    return child;                                                                                   \
+}
+
+
+
+
 #define DEFRULES()
 #define ENDRULES()
 
 
 
 
-#define EXPECT(name, body) { NodePtr child = body; result->Append(std::move(child)); }
+#define EXPECT(name, body) { NodePtr child = body; if (child) { scratch_.push_back(child); } }
 
 
 
 
-#define TX result->Tx(); auto old_pos = pos_;
-#define COMMIT result->Commit();
-#define ROLLBACK result->Rollback(); pos_ = old_pos;
+#define TX auto old_size = scratch_.size(); auto old_pos = pos_;
+#define COMMIT
+#define ROLLBACK scratch_.resize(old_size); pos_ = old_pos;
 
 
 
 
 #define ASTERISK(body)                                                                              \
-while (true) {                                                                                      \
-    TX;                                                                                             \
-    try {                                                                                           \
+if (!failed_) {                                                                                     \
+    while (true) {                                                                                  \
+        TX;                                                                                         \
         body;                                                                                       \
+        if (failed_) {                                                                              \
+            failed_ = false;                                                                        \
+            ROLLBACK;                                                                               \
+            break;                                                                                  \
+        }                                                                                           \
         COMMIT;                                                                                     \
-    } catch (SyntaxError&) {                                                                        \
-        ROLLBACK;                                                                                   \
-        break;                                                                                      \
     }                                                                                               \
 }
 
@@ -160,14 +490,15 @@ while (true) {
 
 
 #define OR(left, right)                                                                             \
-{                                                                                                   \
+if (!failed_) {                                                                                     \
     TX;                                                                                             \
-    try {                                                                                           \
-        left;                                                                                       \
-        COMMIT;                                                                                     \
-    } catch (SyntaxError&) {                                                                        \
+    left;                                                                                           \
+    if (failed_) {                                                                                  \
+        failed_ = false;                                                                            \
         ROLLBACK;                                                                                   \
         right;                                                                                      \
+    } else {                                                                                        \
+        COMMIT;                                                                                     \
     }                                                                                               \
 }
 
@@ -184,43 +515,59 @@ while (true) {
     private:                                                                                        \
         class ASTTokenBasic : public ASTNodeBasic {                                                 \
         public:                                                                                     \
-            const std::string& GetStr() const { return str_; }                                      \
-            explicit ASTTokenBasic(const std::string& str) : str_(str) {}                           \
+            std::string_view GetStr() const { return str_; }                                        \
+                                                                                                    \
+            /* Id in Parser::GetSymbols() for DEFSYMBOL tokens, -1 otherwise */                     \
+            int GetSymbol() const { return symbol_; }                                               \
+                                                                                                    \
+            ASTTokenBasic(std::string_view str, int symbol)                                         \
+                : ASTNodeBasic(NodeList<NodePtr>()), str_(str), symbol_(symbol) {}                  \
                                                                                                     \
         protected:                                                                                  \
-            std::string str_;                                                                       \
+            std::string_view str_;                                                                  \
+            int symbol_;                                                                            \
         };
 #define ENDTOKENS()
 
 
 
 
-#define DEFTOKEN(name, regexp)                                                                      \
+#define DEFTOKEN(name, regexp) DEFLEXEME(name, regexp, false, false)
+#define DEFKEYWORD(name, regexp) DEFLEXEME(name, regexp, true, false)
+/* A token whose text is interned into the parser's symbol table, e.g. identifiers */
+#define DEFSYMBOL(name, regexp) DEFLEXEME(name, regexp, false, true)
+
+#define DEFLEXEME(name, regexp, is_keyword, is_symbol)                                              \
     private:                                                                                        \
-        std::regex Regex##name {"(" regexp ")[^]*"};                                                \
+        bool Registered##name {                                                                     \
+            AddToken(k##name##Type, #name, regexp, is_keyword, &Parser::NextToken##name)};          \
                                                                                                     \
     NodePtr NextToken##name() {                                                                     \
-        Logger logger(__PRETTY_FUNCTION__); /**/                                                 \
-        /* Skip spaces */                                                                           \
-        while (pos_ != str_->end() && std::isspace(*pos_)) { ++pos_; }                              \
-        std::smatch match;                                                                          \
-        bool success = std::regex_match(pos_, str_->cend(), match, Regex##name );                   \
-        if (!success) {                                                                             \
-            std::string what = #name ": Bad token at pos ";                                         \
-            what += std::to_string(pos_ - str_->cbegin());                                          \
-            throw SyntaxError(what);                                                                \
+        if (failed_) {                                                                              \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        if (first_tokens_) {                                                                        \
+            first_tokens_->push_back(k##name##Type);                                                \
+            failed_ = true;                                                                         \
+            return nullptr;                                                                         \
+        }                                                                                           \
+        PROFILE_RULE(name)                                                                          \
+        const Lexer::Token& token = tokens_[pos_];                                                  \
+        if (!lexer_.Accepts(token.kind, k##name##Type)) {                                           \
+            Fail(#name);                                                                            \
+            return nullptr;                                                                         \
         }                                                                                           \
                                                                                                     \
-        auto submatch = match[1];                                                                   \
-        pos_ += match.position(1) + submatch.length();                                              \
-        return std::make_unique<name##Node>(submatch.str());                                        \
+        ++pos_;                                                                                     \
+        std::string_view text = str_.substr(token.offset, token.length);                            \
+        return New<name##Node>(text, is_symbol ? symbols_.Intern(text) : -1);                       \
     }                                                                                               \
                                                                                                     \
     public:                                                                                         \
         static constexpr int k##name##Type = __COUNTER__;                                           \
         class name##Node : public ASTTokenBasic {                                                   \
         public:                                                                                     \
-            explicit name##Node(const std::string& str) : ASTTokenBasic(str) {}                     \
+            name##Node(std::string_view str, int symbol) : ASTTokenBasic(str, symbol) {}            \
                                                                                                     \
             virtual int GetType() const override { return k##name##Type; }                          \
                                                                                                     \
@@ -238,10 +585,29 @@ while (true) {
 
 #define MAINRULE(name)                                                                              \
     public:                                                                                         \
-        NodePtr Parse(const std::string& str) {                                                     \
-            str_ = &str;                                                                            \
-            pos_ = str.begin();                                                                     \
-            return Parse##name();                                                                   \
+        /*                                                                                          \
+         * Token nodes are views into `str`: it must outlive the returned tree, which in turn lives \
+         * until the next Parse() call.                                                             \
+         */                                                                                         \
+        NodePtr Parse(std::string_view str) {                                                       \
+            arena_.release();                                                                       \
+            scratch_.clear();                                                                       \
+            symbols_.Clear();                                                                       \
+            lexer_.Build();                                                                         \
+            BuildOperatorTable();                                                                   \
+            str_ = str;                                                                             \
+            tokens_ = lexer_.Tokenize(str.data(), str.data() + str.size());                         \
+            pos_ = 0;                                                                               \
+            failed_ = false;                                                                        \
+            furthest_pos_ = 0;                                                                      \
+            expected_.clear();                                                                      \
+            memo_.clear();                                                                          \
+            is_memo_enabled_ = tokens_.size() >= memo_threshold_;                                   \
+            NodePtr result = Parse##name();                                                         \
+            if (!result) {                                                                          \
+                throw SyntaxError(FailureMessage());                                                \
+            }                                                                                       \
+            return result;                                                                          \
         }
 
 
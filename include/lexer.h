@@ -0,0 +1,423 @@
+#pragma once
+
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Combined lexer for all tokens of a grammar.
+ *
+ * Every DEFTOKEN registers its pattern here. Build() compiles all patterns into a single NFA
+ * (Thompson construction) and then into a DFA (subset construction). Scan() walks the DFA once
+ * from the current position and returns the longest lexeme together with the DFA state it ended
+ * in; a token matches if its own pattern accepts exactly that lexeme (see Accepts()).
+ * Tokenize() runs Scan() over the whole input once, so a parser can backtrack over the resulting
+ * token array without lexing the same characters again.
+ *
+ * Supported pattern syntax is the subset of ECMAScript regular expressions used by the grammars:
+ * literals, escapes, `.`, bracket expressions with ranges, negation and [:class:] names, groups,
+ * `|`, `*`, `+`, `?`, and `$` which matches the end of the input.
+ */
+class Lexer {
+public:
+    static constexpr int kEndOfInput = 256;
+    static constexpr int kAlphabetSize = 257;
+    static constexpr int kDeadState = -1;
+
+    struct Match {
+        std::size_t length;
+        int state;
+    };
+
+    /* `kind` is the DFA state the lexeme ended in; pass it to Accepts() */
+    struct Token {
+        int kind;
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    bool AddToken(int type, const char* pattern, bool is_keyword) {
+        if (type >= static_cast<int>(index_of_type_.size())) {
+            index_of_type_.resize(type + 1, -1);
+        }
+        index_of_type_[type] = tokens_.size();
+        tokens_.push_back({type, pattern, is_keyword});
+        is_built_ = false;
+        return true;
+    }
+
+    void Build() {
+        if (is_built_) {
+            return;
+        }
+        BuildNfa();
+        BuildDfa();
+        nfa_.clear();
+        is_built_ = true;
+    }
+
+    Match Scan(const char* begin, const char* end) const {
+        Match best{0, kDeadState};
+        int state = 0;
+        for (const char* pos = begin; pos != end; ++pos) {
+            state = next_[state * kAlphabetSize + static_cast<unsigned char>(*pos)];
+            if (state == kDeadState) {
+                return best;
+            }
+            if (IsAccepting(state)) {
+                best = {static_cast<std::size_t>(pos - begin + 1), state};
+            }
+        }
+        state = next_[state * kAlphabetSize + kEndOfInput];
+        if (state != kDeadState && IsAccepting(state)) {
+            best.state = state;
+        }
+        return best;
+    }
+
+    /*
+     * Whitespace between lexemes is skipped. The array ends with the end-of-input lexeme (if the
+     * whole input was recognized) followed by a dead token that no token type accepts.
+     */
+    std::vector<Token> Tokenize(const char* begin, const char* end) const {
+        std::vector<Token> tokens;
+        const char* pos = begin;
+        while (true) {
+            while (pos != end && std::isspace(static_cast<unsigned char>(*pos))) {
+                ++pos;
+            }
+            Match match = Scan(pos, end);
+            tokens.push_back({match.state, static_cast<std::uint32_t>(pos - begin),
+                              static_cast<std::uint32_t>(match.length)});
+            if (match.length == 0) {
+                break;
+            }
+            pos += match.length;
+        }
+        if (tokens.back().kind != kDeadState) {
+            tokens.push_back({kDeadState, static_cast<std::uint32_t>(pos - begin), 0});
+        }
+        return tokens;
+    }
+
+    bool Accepts(int state, int type) const {
+        if (state == kDeadState) {
+            return false;
+        }
+        std::size_t index = index_of_type_[type];
+        return (accepts_[state * words_per_state_ + index / 64] >> (index % 64)) & 1;
+    }
+
+    std::size_t StateCount() const {
+        return is_accepting_.size();
+    }
+
+private:
+    using CharSet = std::bitset<kAlphabetSize>;
+
+    struct TokenInfo {
+        int type;
+        std::string pattern;
+        bool is_keyword;
+    };
+
+    struct NfaState {
+        CharSet chars;
+        int next = -1;
+        std::vector<int> epsilon;
+        int accepted_token = -1;
+    };
+
+    struct Fragment {
+        int start;
+        int finish;
+    };
+
+    /* Recursive-descent parser of a single pattern into an NFA fragment */
+    class PatternParser {
+    public:
+        PatternParser(Lexer* lexer, const std::string& pattern) : lexer_(lexer), str_(pattern) {}
+
+        Fragment Parse() {
+            Fragment result = ParseAlternation();
+            if (pos_ != str_.size()) {
+                Fail("unexpected `)`");
+            }
+            return result;
+        }
+
+    private:
+        Fragment ParseAlternation() {
+            Fragment result = ParseSequence();
+            while (Peek('|')) {
+                ++pos_;
+                Fragment other = ParseSequence();
+                int start = lexer_->NewState();
+                int finish = lexer_->NewState();
+                lexer_->nfa_[start].epsilon = {result.start, other.start};
+                lexer_->nfa_[result.finish].epsilon.push_back(finish);
+                lexer_->nfa_[other.finish].epsilon.push_back(finish);
+                result = {start, finish};
+            }
+            return result;
+        }
+
+        Fragment ParseSequence() {
+            int start = lexer_->NewState();
+            Fragment result{start, start};
+            while (pos_ < str_.size() && !Peek('|') && !Peek(')')) {
+                Fragment item = ParseRepetition();
+                lexer_->nfa_[result.finish].epsilon.push_back(item.start);
+                result.finish = item.finish;
+            }
+            return result;
+        }
+
+        Fragment ParseRepetition() {
+            Fragment atom = ParseAtom();
+            while (Peek('*') || Peek('+') || Peek('?')) {
+                char op = str_[pos_++];
+                int start = lexer_->NewState();
+                int finish = lexer_->NewState();
+                lexer_->nfa_[start].epsilon.push_back(atom.start);
+                lexer_->nfa_[atom.finish].epsilon.push_back(finish);
+                if (op != '+') {
+                    lexer_->nfa_[start].epsilon.push_back(finish);
+                }
+                if (op != '?') {
+                    lexer_->nfa_[atom.finish].epsilon.push_back(atom.start);
+                }
+                atom = {start, finish};
+            }
+            return atom;
+        }
+
+        Fragment ParseAtom() {
+            char c = str_[pos_++];
+            switch (c) {
+                case '(': {
+                    Fragment result = ParseAlternation();
+                    if (!Peek(')')) {
+                        Fail("missing `)`");
+                    }
+                    ++pos_;
+                    return result;
+                }
+                case '[':
+                    return Single(ParseBracket());
+                case '.': {
+                    CharSet chars;
+                    for (int i = 0; i < 256; ++i) {
+                        chars.set(i, i != '\n' && i != '\r');
+                    }
+                    return Single(chars);
+                }
+                case '$': {
+                    CharSet chars;
+                    chars.set(kEndOfInput);
+                    return Single(chars);
+                }
+                case '\\':
+                    if (pos_ == str_.size()) {
+                        Fail("trailing `\\`");
+                    }
+                    c = str_[pos_++];
+                    [[fallthrough]];
+                default: {
+                    CharSet chars;
+                    chars.set(static_cast<unsigned char>(c));
+                    return Single(chars);
+                }
+            }
+        }
+
+        CharSet ParseBracket() {
+            CharSet chars;
+            bool negate = Peek('^');
+            if (negate) {
+                ++pos_;
+            }
+            while (!Peek(']')) {
+                if (pos_ >= str_.size()) {
+                    Fail("missing `]`");
+                }
+                if (str_.compare(pos_, 2, "[:") == 0) {
+                    std::size_t close = str_.find(":]", pos_);
+                    if (close == std::string::npos) {
+                        Fail("missing `:]`");
+                    }
+                    AddClass(str_.substr(pos_ + 2, close - pos_ - 2), &chars);
+                    pos_ = close + 2;
+                    continue;
+                }
+                unsigned char low = BracketChar();
+                unsigned char high = low;
+                if (Peek('-') && pos_ + 1 < str_.size() && str_[pos_ + 1] != ']') {
+                    ++pos_;
+                    high = BracketChar();
+                }
+                for (int i = low; i <= high; ++i) {
+                    chars.set(i);
+                }
+            }
+            ++pos_;
+            if (negate) {
+                chars.flip();
+                chars.reset(kEndOfInput);
+            }
+            return chars;
+        }
+
+        unsigned char BracketChar() {
+            char c = str_[pos_++];
+            if (c == '\\' && pos_ < str_.size()) {
+                c = str_[pos_++];
+            }
+            return static_cast<unsigned char>(c);
+        }
+
+        void AddClass(const std::string& name, CharSet* chars) {
+            for (int i = 0; i < 256; ++i) {
+                bool in_class;
+                if (name == "alpha") {
+                    in_class = std::isalpha(i);
+                } else if (name == "digit") {
+                    in_class = std::isdigit(i);
+                } else if (name == "alnum") {
+                    in_class = std::isalnum(i);
+                } else if (name == "space") {
+                    in_class = std::isspace(i);
+                } else {
+                    Fail("unknown class [:" + name + ":]");
+                }
+                if (in_class) {
+                    chars->set(i);
+                }
+            }
+        }
+
+        Fragment Single(const CharSet& chars) {
+            int start = lexer_->NewState();
+            int finish = lexer_->NewState();
+            lexer_->nfa_[start].chars = chars;
+            lexer_->nfa_[start].next = finish;
+            return {start, finish};
+        }
+
+        bool Peek(char c) const {
+            return pos_ < str_.size() && str_[pos_] == c;
+        }
+
+        [[noreturn]] void Fail(const std::string& what) const {
+            throw std::logic_error("Bad token pattern \"" + str_ + "\": " + what);
+        }
+
+        Lexer* lexer_;
+        const std::string& str_;
+        std::size_t pos_ = 0;
+    };
+
+    int NewState() {
+        nfa_.emplace_back();
+        return nfa_.size() - 1;
+    }
+
+    void BuildNfa() {
+        nfa_.clear();
+        int start = NewState();
+        for (std::size_t i = 0; i < tokens_.size(); ++i) {
+            Fragment fragment = PatternParser(this, tokens_[i].pattern).Parse();
+            nfa_[start].epsilon.push_back(fragment.start);
+            nfa_[fragment.finish].accepted_token = i;
+        }
+    }
+
+    void Closure(std::set<int>* states) const {
+        std::vector<int> stack(states->begin(), states->end());
+        while (!stack.empty()) {
+            int state = stack.back();
+            stack.pop_back();
+            for (int next : nfa_[state].epsilon) {
+                if (states->insert(next).second) {
+                    stack.push_back(next);
+                }
+            }
+        }
+    }
+
+    void BuildDfa() {
+        words_per_state_ = (tokens_.size() + 63) / 64;
+        next_.clear();
+        accepts_.clear();
+        is_accepting_.clear();
+
+        std::map<std::set<int>, int> ids;
+        std::vector<std::set<int>> subsets;
+        std::set<int> initial{0};
+        Closure(&initial);
+        ids.emplace(initial, 0);
+        subsets.push_back(initial);
+
+        for (std::size_t current = 0; current < subsets.size(); ++current) {
+            AddDfaState(subsets[current]);
+            for (int c = 0; c < kAlphabetSize; ++c) {
+                std::set<int> target;
+                for (int state : subsets[current]) {
+                    if (nfa_[state].chars.test(c)) {
+                        target.insert(nfa_[state].next);
+                    }
+                }
+                if (target.empty()) {
+                    continue;
+                }
+                Closure(&target);
+                auto [iter, is_new] = ids.emplace(target, subsets.size());
+                if (is_new) {
+                    subsets.push_back(target);
+                }
+                next_[current * kAlphabetSize + c] = iter->second;
+            }
+        }
+    }
+
+    void AddDfaState(const std::set<int>& subset) {
+        next_.resize(next_.size() + kAlphabetSize, kDeadState);
+        std::size_t offset = accepts_.size();
+        accepts_.resize(offset + words_per_state_, 0);
+
+        bool has_keyword = false;
+        for (int state : subset) {
+            int token = nfa_[state].accepted_token;
+            has_keyword |= token != -1 && tokens_[token].is_keyword;
+        }
+        bool is_accepting = false;
+        for (int state : subset) {
+            int token = nfa_[state].accepted_token;
+            /* Keywords are reserved: a lexeme spelled as a keyword is accepted by keywords only */
+            if (token != -1 && (!has_keyword || tokens_[token].is_keyword)) {
+                accepts_[offset + token / 64] |= std::uint64_t(1) << (token % 64);
+                is_accepting = true;
+            }
+        }
+        is_accepting_.push_back(is_accepting);
+    }
+
+    bool IsAccepting(int state) const {
+        return is_accepting_[state];
+    }
+
+    std::vector<TokenInfo> tokens_;
+    std::vector<int> index_of_type_;
+    std::vector<NfaState> nfa_;
+
+    std::vector<int> next_;
+    std::vector<std::uint64_t> accepts_;
+    std::vector<bool> is_accepting_;
+    std::size_t words_per_state_ = 0;
+    bool is_built_ = false;
+};
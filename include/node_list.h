@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+ * Children of an AST node: a fixed array in the parser's arena. The parser collects the children
+ * of a rule on a scratch stack and copies them here once the rule has matched, so a node never
+ * grows and failed alternatives leave nothing behind.
+ */
+template <class T>
+class NodeList {
+public:
+    NodeList() = default;
+
+    NodeList(T* data, std::size_t size) : data_(data), size_(size) {}
+
+    T* begin() const { return data_; }
+
+    T* end() const { return data_ + size_; }
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    T& operator[](std::size_t index) const { return data_[index]; }
+
+    T& back() const { return data_[size_ - 1]; }
+
+private:
+    T* data_ = nullptr;
+    std::size_t size_ = 0;
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+/*
+ * Per-rule parser statistics. A grammar collects them only when compiled with PARSE_PROFILE;
+ * otherwise the hooks in grammar_pre.h expand to nothing.
+ *
+ * Times are inclusive: a rule's time contains the time of the rules it called.
+ */
+class ParseProfile {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct RuleStats {
+        const char* name = nullptr;
+        std::size_t invocations = 0;
+        std::size_t successes = 0;
+        std::size_t rollbacks = 0;
+        std::size_t memo_hits = 0;
+        std::size_t tokens = 0;
+        Clock::duration time{};
+    };
+
+    /*
+     * Accounts one invocation of a rule or token; the outcome is read when the scope ends. The stats
+     * are looked up again then, since nested rules may grow the table.
+     */
+    class Scope {
+    public:
+        Scope(ParseProfile* profile, int type, const char* name, const std::size_t& pos, const bool& failed)
+            : profile_(profile), type_(type), pos_(pos), failed_(failed), start_pos_(pos),
+              start_time_(Clock::now()) {
+            ++profile->Get(type, name).invocations;
+        }
+
+        ~Scope() {
+            RuleStats& stats = profile_->stats_[type_];
+            stats.time += Clock::now() - start_time_;
+            if (failed_) {
+                ++stats.rollbacks;
+            } else {
+                ++stats.successes;
+                stats.tokens += pos_ - start_pos_;
+            }
+        }
+
+    private:
+        ParseProfile* profile_;
+        int type_;
+        const std::size_t& pos_;
+        const bool& failed_;
+        std::size_t start_pos_;
+        Clock::time_point start_time_;
+    };
+
+    RuleStats& Get(int type, const char* name) {
+        if (type >= static_cast<int>(stats_.size())) {
+            stats_.resize(type + 1);
+        }
+        if (name) {
+            stats_[type].name = name;
+        }
+        return stats_[type];
+    }
+
+    void Clear() {
+        stats_.clear();
+    }
+
+    void PrintTable(std::ostream& out) const {
+        out << std::left << std::setw(28) << "rule" << std::right
+            << std::setw(12) << "calls" << std::setw(12) << "successes" << std::setw(12) << "rollbacks"
+            << std::setw(12) << "memo hits" << std::setw(12) << "tokens" << std::setw(12) << "time, ms" << '\n';
+        for (const RuleStats* stats : Sorted()) {
+            out << std::left << std::setw(28) << stats->name << std::right
+                << std::setw(12) << stats->invocations << std::setw(12) << stats->successes
+                << std::setw(12) << stats->rollbacks << std::setw(12) << stats->memo_hits
+                << std::setw(12) << stats->tokens
+                << std::setw(12) << std::fixed << std::setprecision(3) << Milliseconds(stats->time) << '\n';
+        }
+    }
+
+    void PrintJson(std::ostream& out) const {
+        out << "[\n";
+        bool is_first = true;
+        for (const RuleStats* stats : Sorted()) {
+            if (!is_first) {
+                out << ",\n";
+            }
+            is_first = false;
+            out << "  {\"rule\": " << std::quoted(stats->name)
+                << ", \"calls\": " << stats->invocations
+                << ", \"successes\": " << stats->successes
+                << ", \"rollbacks\": " << stats->rollbacks
+                << ", \"memo_hits\": " << stats->memo_hits
+                << ", \"tokens\": " << stats->tokens
+                << ", \"time_ms\": " << std::fixed << std::setprecision(3) << Milliseconds(stats->time) << '}';
+        }
+        out << "\n]\n";
+    }
+
+private:
+    /* Rules that backtrack the most come first */
+    std::vector<const RuleStats*> Sorted() const {
+        std::vector<const RuleStats*> result;
+        for (const auto& stats : stats_) {
+            if (stats.invocations > 0) {
+                result.push_back(&stats);
+            }
+        }
+        std::stable_sort(result.begin(), result.end(), [](const RuleStats* lhs, const RuleStats* rhs) {
+            return lhs->rollbacks > rhs->rollbacks;
+        });
+        return result;
+    }
+
+    static double Milliseconds(Clock::duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    std::vector<RuleStats> stats_;
+};
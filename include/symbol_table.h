@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Interned identifiers. Every distinct name gets a dense id in order of first appearance, so later
+ * passes can index arrays by symbol instead of hashing strings. Names are views into the parsed
+ * source.
+ */
+class SymbolTable {
+public:
+    int Intern(std::string_view name) {
+        auto [iter, is_new] = ids_.emplace(name, names_.size());
+        if (is_new) {
+            names_.push_back(name);
+        }
+        return iter->second;
+    }
+
+    std::string_view GetName(int symbol) const {
+        return names_[symbol];
+    }
+
+    std::size_t Size() const {
+        return names_.size();
+    }
+
+    void Clear() {
+        ids_.clear();
+        names_.clear();
+    }
+
+private:
+    std::unordered_map<std::string_view, int> ids_;
+    std::vector<std::string_view> names_;
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Prints a module as `.vasm` text for the `asm` tool of the Stack VM project. Each function is
+ * formatted into a buffer that is written at once.
+ */
+class AsmWriter {
+public:
+    explicit AsmWriter(const Module& module) : module_(module) {}
+
+    void Write(std::ostream& out) {
+        for (const auto& function : module_.GetFunctions()) {
+            buffer_ += "func ";
+            buffer_ += module_.GetSymbolName(function.symbol);
+            buffer_ += '\n';
+            for (const auto& instruction : function.code) {
+                WriteInstruction(instruction);
+            }
+            Flush(out);
+        }
+        for (const auto& variable : module_.GetVariables()) {
+            buffer_ += "    var ";
+            buffer_ += module_.GetSymbolName(variable.symbol);
+            buffer_ += ' ';
+            WriteNumber(variable.size);
+            buffer_ += '\n';
+        }
+        Flush(out);
+    }
+
+private:
+    void WriteInstruction(const Instruction& instruction) {
+        if (instruction.op == Opcode::kLabel) {
+            buffer_ += "func ";
+            WriteLabel(instruction.value);
+            buffer_ += '\n';
+            return;
+        }
+
+        buffer_ += "    ";
+        buffer_ += GetMnemonic(instruction.op);
+        switch (instruction.kind) {
+            case Operand::kNone:
+                break;
+            case Operand::kImmediate:
+                buffer_ += ' ';
+                WriteNumber(instruction.value);
+                break;
+            case Operand::kRegister:
+                buffer_ += " %";
+                WriteNumber(instruction.value);
+                break;
+            case Operand::kMemory:
+                buffer_ += " !";
+                WriteNumber(instruction.value);
+                break;
+            case Operand::kSymbol:
+                buffer_ += ' ';
+                buffer_ += module_.GetSymbolName(instruction.value);
+                break;
+            case Operand::kLabel:
+                buffer_ += ' ';
+                WriteLabel(instruction.value);
+                break;
+            case Operand::kLocal:
+            case Operand::kFrameSize:
+                throw std::logic_error("Frame slots must be lowered before printing");
+        }
+        buffer_ += '\n';
+    }
+
+    void WriteLabel(int64_t label) {
+        buffer_ += ".L";
+        WriteNumber(Operand::GetLabelUniqueId(label));
+        buffer_ += GetLabelSuffix(Operand::GetLabelKind(label));
+    }
+
+    void WriteNumber(int64_t value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr);
+    }
+
+    void Flush(std::ostream& out) {
+        out.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+    const Module& module_;
+    std::string buffer_;
+};
+
+}  /* namespace vpl */
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "vpl/instruction.h"
+
+namespace vpl {
+
+/*
+ * Relative cost of each opcode on the target VM, in units of a simple stack operation, for passes
+ * that choose between equivalent instruction sequences. The defaults can be tuned with SetCost.
+ */
+class CostTable {
+public:
+    CostTable() {
+        costs_.fill(1);
+        SetCost(Opcode::kMul, 4);
+        SetCost(Opcode::kDiv, 16);
+        SetCost(Opcode::kMod, 16);
+        SetCost(Opcode::kCall, 4);
+        SetCost(Opcode::kLabel, 0);
+    }
+
+    int GetCost(Opcode op) const {
+        return costs_[static_cast<size_t>(op)];
+    }
+
+    int GetCost(const std::vector<Instruction>& code) const {
+        int cost = 0;
+        for (const auto& instruction : code) {
+            cost += GetCost(instruction.op);
+        }
+        return cost;
+    }
+
+    void SetCost(Opcode op, int cost) {
+        costs_[static_cast<size_t>(op)] = cost;
+    }
+
+private:
+    std::array<int, static_cast<size_t>(Opcode::kLabel) + 1> costs_;
+};
+
+}  /* namespace vpl */
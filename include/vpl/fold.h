@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+#include "vpl/instruction.h"
+
+namespace vpl {
+
+/*
+ * Values the VM computes, for folding constant expressions. Words wrap around, division truncates
+ * toward zero, comparisons and logical operators give 0 or 1. A result that depends on the VM, a
+ * division by zero or a shift by a negative or too large count, is not known at compile time.
+ */
+inline bool Evaluate(Opcode op, int64_t lhs, int64_t rhs, int64_t* result) {
+    uint64_t ulhs = lhs;
+    uint64_t urhs = rhs;
+    switch (op) {
+        case Opcode::kAdd:
+            *result = static_cast<int64_t>(ulhs + urhs);
+            return true;
+        case Opcode::kSub:
+            *result = static_cast<int64_t>(ulhs - urhs);
+            return true;
+        case Opcode::kMul:
+            *result = static_cast<int64_t>(ulhs * urhs);
+            return true;
+        case Opcode::kDiv:
+        case Opcode::kMod:
+            if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+                return false;
+            }
+            *result = op == Opcode::kDiv ? lhs / rhs : lhs % rhs;
+            return true;
+        case Opcode::kShl:
+        case Opcode::kShr:
+            if (rhs < 0 || rhs >= 64) {
+                return false;
+            }
+            *result = op == Opcode::kShl ? static_cast<int64_t>(ulhs << rhs) : lhs >> rhs;
+            return true;
+        case Opcode::kAnd:
+            *result = lhs & rhs;
+            return true;
+        case Opcode::kOr:
+            *result = lhs | rhs;
+            return true;
+        case Opcode::kXor:
+            *result = lhs ^ rhs;
+            return true;
+        case Opcode::kCeq:
+            *result = lhs == rhs;
+            return true;
+        case Opcode::kCne:
+            *result = lhs != rhs;
+            return true;
+        case Opcode::kClt:
+            *result = lhs < rhs;
+            return true;
+        case Opcode::kCle:
+            *result = lhs <= rhs;
+            return true;
+        case Opcode::kCgt:
+            *result = lhs > rhs;
+            return true;
+        case Opcode::kCge:
+            *result = lhs >= rhs;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* `neg`, `not` and `bool`; `xor` stands for the bitwise not, which is `push -1; xor` */
+inline int64_t Evaluate(Opcode op, int64_t value) {
+    switch (op) {
+        case Opcode::kNeg:
+            return static_cast<int64_t>(-static_cast<uint64_t>(value));
+        case Opcode::kNot:
+            return value == 0;
+        case Opcode::kBool:
+            return value != 0;
+        default:
+            return ~value;
+    }
+}
+
+/* Operators whose chains may be evaluated in any order */
+inline bool IsCommutative(Opcode op) {
+    return op == Opcode::kAdd || op == Opcode::kMul || op == Opcode::kAnd || op == Opcode::kOr ||
+           op == Opcode::kXor;
+}
+
+/* `a op b` is `b mirror a` */
+inline bool GetMirror(Opcode op, Opcode* mirror) {
+    switch (op) {
+        case Opcode::kAdd:
+        case Opcode::kMul:
+        case Opcode::kAnd:
+        case Opcode::kOr:
+        case Opcode::kXor:
+        case Opcode::kCeq:
+        case Opcode::kCne:
+            *mirror = op;
+            return true;
+        case Opcode::kClt:
+            *mirror = Opcode::kCgt;
+            return true;
+        case Opcode::kCgt:
+            *mirror = Opcode::kClt;
+            return true;
+        case Opcode::kCle:
+            *mirror = Opcode::kCge;
+            return true;
+        case Opcode::kCge:
+            *mirror = Opcode::kCle;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* `x op identity` is x */
+inline bool GetIdentity(Opcode op, int64_t* identity) {
+    switch (op) {
+        case Opcode::kAdd:
+        case Opcode::kSub:
+        case Opcode::kOr:
+        case Opcode::kXor:
+        case Opcode::kShl:
+        case Opcode::kShr:
+            *identity = 0;
+            return true;
+        case Opcode::kMul:
+        case Opcode::kDiv:
+            *identity = 1;
+            return true;
+        case Opcode::kAnd:
+            *identity = -1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* `x op annihilator` is the annihilator */
+inline bool GetAnnihilator(Opcode op, int64_t* annihilator) {
+    switch (op) {
+        case Opcode::kMul:
+        case Opcode::kAnd:
+            *annihilator = 0;
+            return true;
+        case Opcode::kOr:
+            *annihilator = -1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+}  /* namespace vpl */
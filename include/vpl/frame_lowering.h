@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Turns the frame slot operands of `push` and `pop` into VM addressing, keeping the slots used most
+ * in spare registers. Locals never have their address taken, so a slot in a register lives there for
+ * the whole function and an access is a single `push %r` or `pop %r`. An argument passed in memory
+ * is loaded into its register at the entry. Any other slot stays in memory: offset 0 is at the frame
+ * base, so it is `!frame`, the others have their address computed into the scratch register.
+ *
+ * Slots in memory are colored like registers: two whose live intervals are disjoint share an offset.
+ * Arguments in memory keep the offsets the caller stored them at. The frame size is then known once
+ * for the function, past the last offset in use, and every call moves the stack pointer by it, so
+ * it is zero if all slots have registers.
+ *
+ * Registers are given by linear scan over the live intervals of the slots. An interval spans the
+ * first and the last use, widened to the whole of every loop it meets, and two slots whose intervals
+ * are disjoint share a register. A slot is worth a register by the accesses it saves, uses inside
+ * loops weighing more, less the entry and exit code. When registers run out, the slot worth the
+ * least is spilled.
+ *
+ * Spare registers are saved by the function that uses them: the entry pushes their old values and
+ * every `ret` pops them back. This relies on the function having nothing else on the operand stack
+ * when it returns.
+ */
+class FrameLowering {
+public:
+    FrameLowering(int frame_register, int scratch_register, int first_spare_register,
+                  int spare_register_count)
+        : frame_register_(frame_register), scratch_register_(scratch_register),
+          first_spare_register_(first_spare_register), spare_register_count_(spare_register_count) {}
+
+    void Run(Module* module) {
+        for (auto& function : module->GetFunctions()) {
+            Lower(&function);
+        }
+    }
+
+    void Lower(Module::Function* function) {
+        const std::vector<Instruction>& code = function->code;
+        std::map<int64_t, int> register_of_slot = AllocateRegisters(*function);
+        std::vector<int> used_registers;
+        for (const auto& [slot, reg] : register_of_slot) {
+            used_registers.push_back(reg);
+        }
+        std::sort(used_registers.begin(), used_registers.end());
+        used_registers.erase(std::unique(used_registers.begin(), used_registers.end()), used_registers.end());
+
+        std::vector<Instruction> lowered;
+        lowered.reserve(code.size() + 2 * used_registers.size() + 6 * function->arg_count);
+        for (int reg : used_registers) {
+            lowered.emplace_back(Opcode::kPush, Operand::Register(reg));
+        }
+        for (const auto& [slot, reg] : register_of_slot) {
+            if (IsMemoryArg(*function, slot)) {
+                EmitAccess(&lowered, Opcode::kPush, slot);
+                lowered.emplace_back(Opcode::kPop, Operand::Register(reg));
+            }
+        }
+
+        std::map<int64_t, int64_t> offset_of_slot = AssignFrameOffsets(*function, register_of_slot);
+        function->frame_size = 0;
+        for (const auto& [slot, offset] : offset_of_slot) {
+            function->frame_size = std::max(function->frame_size, static_cast<int>(offset) + 1);
+        }
+
+        for (const auto& instruction : code) {
+            if (instruction.kind == Operand::kFrameSize) {
+                lowered.emplace_back(instruction.op, Operand::Immediate(function->frame_size));
+                continue;
+            }
+            if (instruction.kind == Operand::kLocal) {
+                auto iter = register_of_slot.find(instruction.value);
+                if (iter != register_of_slot.end()) {
+                    lowered.emplace_back(instruction.op, Operand::Register(iter->second));
+                } else {
+                    EmitAccess(&lowered, instruction.op, offset_of_slot.at(instruction.value));
+                }
+                continue;
+            }
+            if (instruction.op == Opcode::kRet) {
+                for (auto iter = used_registers.rbegin(); iter != used_registers.rend(); ++iter) {
+                    lowered.emplace_back(Opcode::kPop, Operand::Register(*iter));
+                }
+            }
+            lowered.push_back(instruction);
+        }
+        function->code.swap(lowered);
+    }
+
+    /* Slots live at each position of the code, over the intervals that registers are given by */
+    static std::vector<int> GetLiveSlotCounts(const Module::Function& function) {
+        std::vector<int> delta(function.code.size() + 1);
+        for (const auto& interval : GetIntervals(function)) {
+            ++delta[interval.start];
+            --delta[interval.end + 1];
+        }
+
+        std::vector<int> counts(function.code.size());
+        int count = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            count += delta[i];
+            counts[i] = count;
+        }
+        return counts;
+    }
+
+private:
+    /*
+     * Gives each slot in memory the first offset that is free over its interval, in order of start.
+     * An offset is free after the last position it is used at, -1 if it is not used yet.
+     */
+    std::map<int64_t, int64_t> AssignFrameOffsets(const Module::Function& function,
+                                                  const std::map<int64_t, int>& register_of_slot) const {
+        std::vector<Interval> intervals = GetIntervals(function);
+        std::sort(intervals.begin(), intervals.end(), [](const Interval& lhs, const Interval& rhs) {
+            return lhs.start != rhs.start ? lhs.start < rhs.start : lhs.slot < rhs.slot;
+        });
+
+        std::map<int64_t, int64_t> offset_of_slot;
+        std::vector<int64_t> used_until(function.arg_count, -1);
+        for (int64_t slot = function.register_arg_count; slot < function.arg_count; ++slot) {
+            offset_of_slot[slot] = slot;
+            used_until[slot] = 0;
+        }
+        for (const auto& interval : intervals) {
+            if (register_of_slot.count(interval.slot)) {
+                continue;
+            }
+            int64_t start = interval.start;
+            int64_t end = interval.end;
+            if (IsMemoryArg(function, interval.slot)) {
+                used_until[interval.slot] = end;
+                continue;
+            }
+            auto iter = std::find_if(used_until.begin(), used_until.end(), [start](int64_t last_use) {
+                return last_use < start;
+            });
+            if (iter == used_until.end()) {
+                iter = used_until.insert(iter, -1);
+            }
+            *iter = end;
+            offset_of_slot[interval.slot] = iter - used_until.begin();
+        }
+        return offset_of_slot;
+    }
+
+    /* Costs in register accesses: memory is taken as twice as slow, an address takes 4 more */
+    static constexpr int64_t kRegisterCost = 1;
+    static constexpr int64_t kFrameBaseCost = 2;
+    static constexpr int64_t kFrameSlotCost = kFrameBaseCost + 4;
+    /* Saving the register at the entry and restoring it at the exit */
+    static constexpr int64_t kSaveCost = 2;
+    static constexpr int64_t kLoopWeight = 8;
+    static constexpr int kMaxLoopDepth = 4;
+
+    struct Interval {
+        int64_t slot;
+        size_t start;
+        size_t end;
+        int64_t benefit;
+    };
+
+    /* A jump back to a label, given by the positions of both */
+    using Loop = std::pair<size_t, size_t>;
+
+    static int64_t GetMemoryCost(int64_t slot) {
+        return slot != 0 ? kFrameSlotCost : kFrameBaseCost;
+    }
+
+    /* `push|pop !frame`, or `push slot; push %frame; add; pop %scratch; push|pop !scratch` */
+    void EmitAccess(std::vector<Instruction>* code, Opcode op, int64_t slot) const {
+        if (slot != 0) {
+            code->emplace_back(Opcode::kPush, Operand::Immediate(slot));
+            code->emplace_back(Opcode::kPush, Operand::Register(frame_register_));
+            code->emplace_back(Opcode::kAdd, Operand());
+            code->emplace_back(Opcode::kPop, Operand::Register(scratch_register_));
+        }
+        code->emplace_back(op, Operand::Memory(slot != 0 ? scratch_register_ : frame_register_));
+    }
+
+    static std::vector<Loop> GetLoops(const std::vector<Instruction>& code) {
+        std::map<int64_t, size_t> label_pos;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].op == Opcode::kLabel) {
+                label_pos[code[i].value] = i;
+            }
+        }
+
+        std::vector<Loop> loops;
+        for (size_t i = 0; i < code.size(); ++i) {
+            bool is_jump =
+                code[i].op == Opcode::kJmp || code[i].op == Opcode::kJz || code[i].op == Opcode::kJnz;
+            if (!is_jump || code[i].kind != Operand::kLabel) {
+                continue;
+            }
+            auto iter = label_pos.find(code[i].value);
+            if (iter != label_pos.end() && iter->second < i) {
+                loops.emplace_back(iter->second, i);
+            }
+        }
+        return loops;
+    }
+
+    /* Every instruction of a loop is one loop deeper */
+    static std::vector<int> GetLoopDepths(size_t code_size, const std::vector<Loop>& loops) {
+        std::vector<int> delta(code_size + 1);
+        for (const auto& [begin, end] : loops) {
+            ++delta[begin];
+            --delta[end + 1];
+        }
+
+        std::vector<int> depths(code_size);
+        int depth = 0;
+        for (size_t i = 0; i < code_size; ++i) {
+            depth += delta[i];
+            depths[i] = depth;
+        }
+        return depths;
+    }
+
+    static bool IsMemoryArg(const Module::Function& function, int64_t slot) {
+        return function.register_arg_count <= slot && slot < function.arg_count;
+    }
+
+    static std::vector<Interval> GetIntervals(const Module::Function& function) {
+        const std::vector<Instruction>& code = function.code;
+        std::vector<Loop> loops = GetLoops(code);
+        std::vector<int> depths = GetLoopDepths(code.size(), loops);
+
+        std::map<int64_t, Interval> interval_of_slot;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].kind != Operand::kLocal) {
+                continue;
+            }
+            int64_t weight = 1;
+            for (int depth = std::min(depths[i], kMaxLoopDepth); depth > 0; --depth) {
+                weight *= kLoopWeight;
+            }
+            int64_t slot = code[i].value;
+            /* An argument in memory is live from the entry, where it is loaded */
+            size_t start = IsMemoryArg(function, slot) ? 0 : i;
+            auto iter = interval_of_slot.try_emplace(slot, Interval{slot, start, i, 0}).first;
+            iter->second.end = i;
+            iter->second.benefit += weight * (GetMemoryCost(slot) - kRegisterCost);
+        }
+
+        std::vector<Interval> intervals;
+        for (auto& [slot, interval] : interval_of_slot) {
+            interval.benefit -= kSaveCost;
+            if (IsMemoryArg(function, slot)) {
+                interval.benefit -= GetMemoryCost(slot) + kRegisterCost;
+            }
+
+            /* A value used in a loop may be carried over to its next iteration */
+            bool is_changed = true;
+            while (is_changed) {
+                is_changed = false;
+                for (const auto& [begin, end] : loops) {
+                    if (interval.start <= end && begin <= interval.end &&
+                        (begin < interval.start || interval.end < end)) {
+                        interval.start = std::min(interval.start, begin);
+                        interval.end = std::max(interval.end, end);
+                        is_changed = true;
+                    }
+                }
+            }
+            intervals.push_back(interval);
+        }
+        return intervals;
+    }
+
+    std::map<int64_t, int> AllocateRegisters(const Module::Function& function) const {
+        std::vector<Interval> intervals;
+        for (const auto& interval : GetIntervals(function)) {
+            if (interval.benefit > 0) {
+                intervals.push_back(interval);
+            }
+        }
+        std::sort(intervals.begin(), intervals.end(), [](const Interval& lhs, const Interval& rhs) {
+            return lhs.start != rhs.start ? lhs.start < rhs.start : lhs.slot < rhs.slot;
+        });
+
+        std::map<int64_t, int> register_of_slot;
+        std::vector<int> free_registers;
+        for (int i = spare_register_count_ - 1; i >= 0; --i) {
+            free_registers.push_back(first_spare_register_ + i);
+        }
+        std::vector<Interval> active;
+        for (const auto& interval : intervals) {
+            for (auto iter = active.begin(); iter != active.end();) {
+                if (iter->end < interval.start) {
+                    free_registers.push_back(register_of_slot[iter->slot]);
+                    iter = active.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
+
+            if (!free_registers.empty()) {
+                register_of_slot[interval.slot] = free_registers.back();
+                free_registers.pop_back();
+                active.push_back(interval);
+                continue;
+            }
+
+            /* Spill the lightest of the live slots, which may be this one */
+            auto lightest = std::min_element(active.begin(), active.end(), [](const Interval& lhs,
+                                                                               const Interval& rhs) {
+                return lhs.benefit < rhs.benefit;
+            });
+            if (lightest != active.end() && lightest->benefit < interval.benefit) {
+                register_of_slot[interval.slot] = register_of_slot[lightest->slot];
+                register_of_slot.erase(lightest->slot);
+                *lightest = interval;
+            }
+        }
+        return register_of_slot;
+    }
+
+    int frame_register_;
+    int scratch_register_;
+    int first_spare_register_;
+    int spare_register_count_;
+};
+
+}  /* namespace vpl */
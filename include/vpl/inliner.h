@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vpl/frame_lowering.h"
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Replaces calls of small functions with their code. It works on the instruction stream before
+ * FrameLowering, so a callee is still in frame slots: its slots are moved right after the slots the
+ * caller has in use at the call, its arguments are popped straight into them, and every `ret` jumps
+ * to a continuation label with the return value left on the operand stack.
+ *
+ * Functions are handled callees first, so an inlined body already has its own calls inlined. A
+ * function that can call itself is never inlined, a callee is inlined if it is not larger than the
+ * size limit or is declared `inline`, and a caller never grows past kMaxGrowth times its size. The
+ * callee's slots join the caller's frame, so a callee not declared `inline` is also kept out when
+ * they and the caller's slots live at the call would not fit in the spare registers together.
+ *
+ * The call sequence is the one Scope::CallFunction emits:
+ *     pop %arg (register arguments)
+ *     push FrameSize(F); push %1; add; pop %1
+ *     pop !1 or push i; push %1; add; pop %2; pop !2 (arguments in memory)
+ *     call f
+ *     push %1; push FrameSize(F); sub; pop %1
+ *     push %3
+ */
+class Inliner {
+public:
+    Inliner(int frame_register, int return_register, int first_arg_register, int spare_register_count,
+            int size_limit)
+        : frame_register_(frame_register), return_register_(return_register),
+          first_arg_register_(first_arg_register), spare_register_count_(spare_register_count),
+          size_limit_(size_limit) {}
+
+    void Run(Module* module) {
+        module_ = module;
+        auto& functions = module->GetFunctions();
+        for (size_t i = 0; i < functions.size(); ++i) {
+            function_of_symbol_[functions[i].symbol] = i;
+        }
+        for (const auto& function : functions) {
+            for (const auto& instruction : function.code) {
+                if (instruction.kind == Operand::kLabel) {
+                    int unique_id = Operand::GetLabelUniqueId(instruction.value);
+                    next_label_id_ = std::max(next_label_id_, unique_id + 1);
+                }
+            }
+        }
+
+        callees_.resize(functions.size());
+        for (size_t i = 0; i < functions.size(); ++i) {
+            for (const auto& instruction : functions[i].code) {
+                if (instruction.op == Opcode::kCall && function_of_symbol_.count(instruction.value)) {
+                    callees_[i].push_back(function_of_symbol_.at(instruction.value));
+                }
+            }
+        }
+
+        is_visited_.assign(functions.size(), false);
+        for (size_t i = 0; i < functions.size(); ++i) {
+            Visit(i);
+        }
+    }
+
+    void PrintReport(std::ostream& out) const {
+        out << std::left << std::setw(32) << "call" << std::setw(12) << "inlined" << "reason\n";
+        for (const auto& decision : decisions_) {
+            out << std::left << std::setw(32) << decision.call << std::setw(12)
+                << (decision.is_inlined ? "yes" : "no") << decision.reason << '\n';
+        }
+    }
+
+private:
+    static constexpr size_t kMaxGrowth = 4;
+    /* Room every caller has to grow, so that small callers can inline too */
+    static constexpr size_t kMinGrowth = 256;
+
+    struct Decision {
+        std::string call;
+        bool is_inlined;
+        std::string reason;
+    };
+
+    /* Inlines into the callees first */
+    void Visit(size_t function) {
+        if (is_visited_[function]) {
+            return;
+        }
+        is_visited_[function] = true;
+        for (size_t callee : callees_[function]) {
+            Visit(callee);
+        }
+        InlineCalls(&module_->GetFunctions()[function]);
+    }
+
+    bool IsRecursive(size_t function) const {
+        std::vector<bool> is_reached(callees_.size(), false);
+        std::vector<size_t> stack = callees_[function];
+        while (!stack.empty()) {
+            size_t current = stack.back();
+            stack.pop_back();
+            if (current == function) {
+                return true;
+            }
+            if (!is_reached[current]) {
+                is_reached[current] = true;
+                stack.insert(stack.end(), callees_[current].begin(), callees_[current].end());
+            }
+        }
+        return false;
+    }
+
+    /* Instructions of a function without its labels and the moves of its register arguments */
+    static size_t GetSize(const Module::Function& function) {
+        size_t size = 0;
+        for (const auto& instruction : function.code) {
+            size += instruction.op != Opcode::kLabel;
+        }
+        return size - 2 * function.register_arg_count;
+    }
+
+    void InlineCalls(Module::Function* caller) {
+        size_t max_size = std::max(kMaxGrowth * caller->code.size(), caller->code.size() + kMinGrowth);
+        std::vector<int> live_slots = FrameLowering::GetLiveSlotCounts(*caller);
+        std::vector<Instruction> code;
+        code.reserve(caller->code.size());
+        for (size_t i = 0; i < caller->code.size(); ++i) {
+            const Instruction& instruction = caller->code[i];
+            if (instruction.op != Opcode::kCall || !function_of_symbol_.count(instruction.value)) {
+                code.push_back(instruction);
+                continue;
+            }
+
+            size_t callee_index = function_of_symbol_.at(instruction.value);
+            const Module::Function& callee = module_->GetFunctions()[callee_index];
+            std::string reason;
+            int64_t frame_size = 0;
+            bool is_inlined = false;
+            size_t size = GetSize(callee);
+            int slot_count = live_slots[i] + GetMaxLiveSlotCount(callee);
+            if (IsRecursive(callee_index)) {
+                reason = "recursive";
+            } else if (!callee.is_inline && size > static_cast<size_t>(size_limit_)) {
+                reason = "size " + std::to_string(size) + " over limit " + std::to_string(size_limit_);
+            } else if (!callee.is_inline && slot_count > spare_register_count_) {
+                reason = "slots would spill: " + std::to_string(slot_count) + " live over " +
+                         std::to_string(spare_register_count_) + " registers";
+            } else if (code.size() + size + (caller->code.size() - i) > max_size) {
+                reason = "caller would grow past " + std::to_string(max_size);
+            } else if (!MatchCall(code, caller->code, i, callee, &frame_size)) {
+                reason = "unknown call sequence";
+            } else {
+                is_inlined = true;
+                reason = callee.is_inline ? "declared inline"
+                                          : "size " + std::to_string(size) + " within limit " +
+                                                std::to_string(size_limit_);
+            }
+            decisions_.push_back({std::string(module_->GetSymbolName(caller->symbol)) + " <- " +
+                                      std::string(module_->GetSymbolName(callee.symbol)),
+                                  is_inlined, reason});
+            if (!is_inlined) {
+                code.push_back(instruction);
+                continue;
+            }
+
+            code.erase(code.end() - GetArgumentsSize(callee), code.end());
+            InlineBody(&code, callee, frame_size);
+            /* The stack pointer restore and the push of the return value */
+            i += 5;
+        }
+        caller->code.swap(code);
+    }
+
+    static int GetMaxLiveSlotCount(const Module::Function& function) {
+        std::vector<int> counts = FrameLowering::GetLiveSlotCounts(function);
+        return counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+    }
+
+    /* Instructions that pass the arguments and move the stack pointer before the call */
+    static size_t GetArgumentsSize(const Module::Function& callee) {
+        size_t size = callee.register_arg_count + 4;
+        for (int i = callee.register_arg_count; i < callee.arg_count; ++i) {
+            size += i != 0 ? 5 : 1;
+        }
+        return size;
+    }
+
+    /* Checks the call sequence around the call at `pos`, the part before it is already in `code` */
+    bool MatchCall(const std::vector<Instruction>& code, const std::vector<Instruction>& caller_code,
+                   size_t pos, const Module::Function& callee, int64_t* frame_size) const {
+        size_t size = GetArgumentsSize(callee);
+        if (code.size() < size || pos + 5 >= caller_code.size() ||
+            callee.code.size() < 2 * static_cast<size_t>(callee.register_arg_count)) {
+            return false;
+        }
+        const Instruction* before = code.data() + code.size() - size;
+        for (int i = 0; i < callee.register_arg_count; ++i) {
+            if (!Is(before[i], Opcode::kPop, Operand::kRegister, first_arg_register_ + i)) {
+                return false;
+            }
+        }
+        const Instruction& adjust = before[callee.register_arg_count];
+        if (adjust.op != Opcode::kPush || adjust.kind != Operand::kFrameSize) {
+            return false;
+        }
+        const Instruction* after = caller_code.data() + pos + 1;
+        if (!Is(after[1], Opcode::kPush, Operand::kFrameSize, adjust.value) ||
+            !Is(after[3], Opcode::kPop, Operand::kRegister, frame_register_) ||
+            !Is(after[4], Opcode::kPush, Operand::kRegister, return_register_)) {
+            return false;
+        }
+        for (int i = 0; i < callee.register_arg_count; ++i) {
+            if (!Is(callee.code[2 * i], Opcode::kPush, Operand::kRegister, first_arg_register_ + i) ||
+                !Is(callee.code[2 * i + 1], Opcode::kPop, Operand::kLocal, i)) {
+                return false;
+            }
+        }
+        *frame_size = adjust.value;
+        return true;
+    }
+
+    /*
+     * The arguments are on the stack, the first on top. The callee's slots start at `frame_size`, and
+     * its labels get new ids.
+     */
+    void InlineBody(std::vector<Instruction>* code, const Module::Function& callee, int64_t frame_size) {
+        for (int i = 0; i < callee.arg_count; ++i) {
+            code->emplace_back(Opcode::kPop, Operand::Local(frame_size + i));
+        }
+
+        std::unordered_map<int, int> label_ids;
+        int continuation = next_label_id_++;
+        bool is_continued = false;
+        for (size_t i = 2 * callee.register_arg_count; i < callee.code.size(); ++i) {
+            Instruction instruction = callee.code[i];
+            switch (instruction.kind) {
+                case Operand::kLocal:
+                case Operand::kFrameSize:
+                    instruction.value += frame_size;
+                    break;
+                case Operand::kLabel: {
+                    auto [iter, is_new] = label_ids.try_emplace(Operand::GetLabelUniqueId(instruction.value),
+                                                                next_label_id_);
+                    next_label_id_ += is_new;
+                    LabelKind kind = Operand::GetLabelKind(instruction.value);
+                    instruction.value = Operand::Label(iter->second, kind).value;
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            if (instruction.op != Opcode::kRet) {
+                code->push_back(instruction);
+                continue;
+            }
+            /* The return value stays on the stack, falling off the end leaves %3 there */
+            if (!code->empty() && Is(code->back(), Opcode::kPop, Operand::kRegister, return_register_)) {
+                code->pop_back();
+            } else {
+                code->emplace_back(Opcode::kPush, Operand::Register(return_register_));
+            }
+            if (i + 1 != callee.code.size()) {
+                code->emplace_back(Opcode::kJmp, Operand::Label(continuation, LabelKind::kReturn));
+                is_continued = true;
+            }
+        }
+        if (is_continued) {
+            code->emplace_back(Opcode::kLabel, Operand::Label(continuation, LabelKind::kReturn));
+        }
+    }
+
+    int frame_register_;
+    int return_register_;
+    int first_arg_register_;
+    int spare_register_count_;
+    int size_limit_;
+
+    Module* module_ = nullptr;
+    std::unordered_map<int64_t, size_t> function_of_symbol_;
+    std::vector<std::vector<size_t>> callees_;
+    std::vector<bool> is_visited_;
+    int next_label_id_ = 0;
+    std::vector<Decision> decisions_;
+};
+
+}  /* namespace vpl */
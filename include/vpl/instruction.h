@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+
+namespace vpl {
+
+/* Instructions the code generator uses, with their assembler mnemonics */
+enum class Opcode : uint8_t {
+    kPush, kPop, kDup,
+    kAdd, kSub, kMul, kDiv, kMod, kNeg,
+    kAnd, kOr, kXor, kNot, kBool, kShl, kShr,
+    kCeq, kCne, kClt, kCle, kCgt, kCge,
+    kJmp, kJz, kJnz, kCall, kRet,
+    kLabel,  /* not an instruction: marks the position of the label in its operand */
+};
+
+inline const char* GetMnemonic(Opcode op) {
+    static const char* const kMnemonics[] = {
+        "push", "pop", "dup",
+        "add", "sub", "mul", "div", "mod", "neg",
+        "and", "or", "xor", "not", "bool", "shl", "shr",
+        "ceq", "cne", "clt", "cle", "cgt", "cge",
+        "jmp", "jz", "jnz", "call", "ret",
+        "func",
+    };
+    return kMnemonics[static_cast<int>(op)];
+}
+
+/* What a local label of a statement marks, the label is named `.L<unique id><suffix>` */
+enum class LabelKind {
+    kIf, kThen, kElse, kEnd,
+    kWhile, kDoWhile, kFor, kCond,
+    kEntry, kReturn,
+    kCount,
+};
+
+inline const char* GetLabelSuffix(LabelKind kind) {
+    static const char* const kSuffixes[] = {
+        "_if", "_then", "_else", "_end",
+        "_while", "_do_while", "_for", "_cond",
+        "_entry", "_return",
+    };
+    return kSuffixes[static_cast<int>(kind)];
+}
+
+/*
+ * Instruction argument: a number, a register %N, memory at the address in a register !N, or an
+ * address resolved by the assembler or the linker, given by a symbol id or by a local label id.
+ * A local is a frame slot of the function, FrameLowering turns it into VM addressing. A frame size
+ * counts the slots in scope at a call, and FrameLowering turns it into the size of the whole frame.
+ */
+struct Operand {
+    enum Kind : uint8_t { kNone, kImmediate, kRegister, kMemory, kSymbol, kLabel, kLocal, kFrameSize };
+
+    static Operand Immediate(int64_t value) {
+        return {kImmediate, value};
+    }
+
+    static Operand Register(int reg) {
+        return {kRegister, reg};
+    }
+
+    static Operand Memory(int reg) {
+        return {kMemory, reg};
+    }
+
+    static Operand Symbol(int symbol) {
+        return {kSymbol, symbol};
+    }
+
+    static Operand Local(int offset) {
+        return {kLocal, offset};
+    }
+
+    static Operand FrameSize(int slot_count) {
+        return {kFrameSize, slot_count};
+    }
+
+    static Operand Label(int unique_id, LabelKind label) {
+        return {kLabel, unique_id * static_cast<int64_t>(LabelKind::kCount) + static_cast<int>(label)};
+    }
+
+    static int GetLabelUniqueId(int64_t label) {
+        return label / static_cast<int>(LabelKind::kCount);
+    }
+
+    static LabelKind GetLabelKind(int64_t label) {
+        return static_cast<LabelKind>(label % static_cast<int>(LabelKind::kCount));
+    }
+
+    Kind kind = kNone;
+    int64_t value = 0;
+};
+
+/* 16 bytes: the operand is stored inline, with its kind packed next to the opcode */
+struct Instruction {
+    Instruction(Opcode op, const Operand& operand) : op(op), kind(operand.kind), value(operand.value) {}
+
+    Operand GetOperand() const {
+        return {kind, value};
+    }
+
+    Opcode op;
+    Operand::Kind kind;
+    int64_t value;
+};
+
+/* Matching an instruction by its opcode and operand, for the passes that rewrite code */
+inline bool Is(const Instruction& instruction, Opcode op, Operand::Kind kind) {
+    return instruction.op == op && instruction.kind == kind;
+}
+
+inline bool Is(const Instruction& instruction, Opcode op, Operand::Kind kind, int64_t value) {
+    return Is(instruction, op, kind) && instruction.value == value;
+}
+
+}  /* namespace vpl */
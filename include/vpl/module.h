@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "symbol_table.h"
+#include "vpl/instruction.h"
+
+namespace vpl {
+
+/*
+ * Output of the code generator: the code of every function as a vector of typed instructions, and
+ * the global variables. Names are symbol ids of the parsed source. The printers (AsmWriter,
+ * ObjectWriter) turn it into a file once code generation is over.
+ */
+class Module {
+public:
+    struct Function {
+        int symbol;
+        int arg_count;
+        int register_arg_count;  /* the first arguments, the rest are in their frame slots */
+        bool is_inline;          /* declared `inline`, a hint for the Inliner */
+        int max_stack_depth;     /* operand stack words at most, as counted and then as verified */
+        int frame_size;          /* frame words in memory, known once FrameLowering placed the slots */
+        std::vector<Instruction> code;
+    };
+
+    struct Variable {
+        int symbol;
+        int size;
+    };
+
+    explicit Module(const SymbolTable& symbols) : symbols_(symbols) {}
+
+    /* Starts a function: the following instructions are its code */
+    void BeginFunction(int symbol, int arg_count, int register_arg_count, bool is_inline) {
+        functions_.push_back({symbol, arg_count, register_arg_count, is_inline, 0, 0, {}});
+    }
+
+    void Emit(Opcode op, const Operand& operand = Operand()) {
+        functions_.back().code.emplace_back(op, operand);
+    }
+
+    void Label(int unique_id, LabelKind label) {
+        Emit(Opcode::kLabel, Operand::Label(unique_id, label));
+    }
+
+    void AddVariable(int symbol, int size) {
+        variables_.push_back({symbol, size});
+    }
+
+    std::vector<Function>& GetFunctions() {
+        return functions_;
+    }
+
+    const std::vector<Function>& GetFunctions() const {
+        return functions_;
+    }
+
+    const std::vector<Variable>& GetVariables() const {
+        return variables_;
+    }
+
+    std::string_view GetSymbolName(int symbol) const {
+        return symbols_.GetName(symbol);
+    }
+
+    static std::string GetLabelName(int64_t label) {
+        std::string name = ".L" + std::to_string(Operand::GetLabelUniqueId(label));
+        name += GetLabelSuffix(Operand::GetLabelKind(label));
+        return name;
+    }
+
+private:
+    const SymbolTable& symbols_;
+    std::vector<Function> functions_;
+    std::vector<Variable> variables_;
+};
+
+}  /* namespace vpl */
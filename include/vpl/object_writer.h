@@ -0,0 +1,260 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Encodes a module directly into a `.vobj` object file of the Stack VM project, the same file
+ * its `asm` tool makes from `.vasm` text (see example/phibonacci.c.vobj.objdump.log).
+ *
+ * An instruction is its opcode byte and, for an argument, a kind byte followed by the value: 0 and
+ * 8 bytes of a number, 2 and a register, 3 and a register holding the address. Jump, call and symbol
+ * arguments are numbers left zero, with a relocation naming the symbol at the offset of the value.
+ *
+ * The file is a tagged stream: integers take the shortest of 'b', 'w', 'd', 'q' (1, 2, 4, 8 bytes,
+ * little endian), a string is its length and bytes, and every string written takes the next index,
+ * so a repeated one is written as the bitwise NOT of the index it got last time. The sections are
+ * the magic, the number of strings after the object type, the object type "vobj", the processor
+ * version, the file type, the code, the symbols, the relocations and the size of the variables.
+ * A last section "vstk", shaped like the symbols, gives each function's deepest operand stack and
+ * its frame size, as StackVerifier and FrameLowering found them, for the VM to preallocate.
+ *
+ * Only the opcodes seen in the Stack VM examples are known, others are rejected, except for `jnz`,
+ * which is made of `jz` and `jmp`.
+ */
+class ObjectWriter {
+public:
+    explicit ObjectWriter(const Module& module) : module_(module) {}
+
+    void Write(std::ostream& out) {
+        Encode();
+
+        Serializer header;
+        header.bytes += 's';
+        header.WriteString("OOSFv1");
+
+        Serializer body;
+        body.string_count = header.string_count;
+        body.bytes += '!';
+        body.WriteString("vobj");
+        int header_strings = body.string_count;
+
+        body.WriteInt(kProcessorVersion[0]);
+        body.WriteInt(kProcessorVersion[1]);
+        body.WriteInt(kProcessorVersion[2]);
+        body.WriteInt(kStaticLinkable);
+
+        body.bytes += "vb";
+        body.WriteInt(code_.size());
+        body.bytes.append(code_.begin(), code_.end());
+
+        body.bytes += "ms!";
+        body.WriteString("vsym");
+        body.WriteInt(symbols_.size());
+        for (const auto& symbol : symbols_) {
+            body.WriteString(symbol.name);
+            body.WriteInt(symbol.offset);
+            body.WriteInt(symbol.type);
+        }
+
+        body.bytes += "mqs";
+        body.WriteInt(relocations_.size());
+        for (const auto& relocation : relocations_) {
+            AppendRaw(&body.bytes, relocation.offset, 8);
+            body.WriteString(relocation.name);
+        }
+
+        body.WriteInt(variables_size_);
+
+        body.bytes += "ms!";
+        body.WriteString("vstk");
+        body.WriteInt(module_.GetFunctions().size());
+        for (const auto& function : module_.GetFunctions()) {
+            body.WriteString(module_.GetSymbolName(function.symbol));
+            body.WriteInt(function.max_stack_depth);
+            body.WriteInt(function.frame_size);
+        }
+
+        header.WriteInt(body.string_count - header_strings);
+        out << header.bytes << body.bytes;
+    }
+
+private:
+    enum SymbolType {
+        kFunctionSymbol = 0,
+        kVariableSymbol = 1,
+    };
+
+    enum ArgKind {
+        kImmediateArg = 0,
+        kRegisterArg = 2,
+        kMemoryArg = 3,
+    };
+
+    static constexpr int kProcessorVersion[] = {0, 5, 0};
+    static constexpr int kStaticLinkable = 0;
+
+    /* Indexed by Opcode, -1 where the encoding is unknown */
+    static constexpr int kOpcodes[] = {
+        0x01, 0x02, 0x27,
+        0x03, 0x04, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, 0x33, -1, -1, -1,
+        0x18, 0x19, -1, 0x23, 0x24,
+        -1,
+    };
+
+    struct Symbol {
+        std::string name;
+        int64_t offset;
+        SymbolType type;
+    };
+
+    struct Relocation {
+        uint64_t offset;
+        std::string name;
+    };
+
+    struct Serializer {
+        void WriteInt(int64_t value) {
+            if (value == static_cast<int8_t>(value)) {
+                bytes += 'b';
+                AppendRaw(&bytes, value, 1);
+            } else if (value == static_cast<int16_t>(value)) {
+                bytes += 'w';
+                AppendRaw(&bytes, value, 2);
+            } else if (value == static_cast<int32_t>(value)) {
+                bytes += 'd';
+                AppendRaw(&bytes, value, 4);
+            } else {
+                bytes += 'q';
+                AppendRaw(&bytes, value, 8);
+            }
+        }
+
+        void WriteString(std::string_view str) {
+            auto iter = last_index.find(str);
+            if (iter != last_index.end()) {
+                WriteInt(~static_cast<int64_t>(iter->second));
+                iter->second = string_count++;
+                return;
+            }
+            WriteInt(str.size());
+            bytes += str;
+            last_index.emplace(str, string_count++);
+        }
+
+        std::string bytes;
+        std::unordered_map<std::string_view, int> last_index;
+        int string_count = 0;
+    };
+
+    template <class Buffer>
+    static void AppendRaw(Buffer* buffer, uint64_t value, int size) {
+        for (int i = 0; i < size; ++i) {
+            buffer->push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void Encode() {
+        for (const auto& function : module_.GetFunctions()) {
+            AddSymbol(std::string(module_.GetSymbolName(function.symbol)), kFunctionSymbol);
+            for (const auto& instruction : function.code) {
+                EncodeInstruction(instruction);
+            }
+        }
+        for (const auto& variable : module_.GetVariables()) {
+            symbols_.push_back({std::string(module_.GetSymbolName(variable.symbol)), variables_size_,
+                                kVariableSymbol});
+            variables_size_ += variable.size;
+        }
+    }
+
+    void EncodeInstruction(const Instruction& instruction) {
+        if (instruction.op == Opcode::kLabel) {
+            AddSymbol(Module::GetLabelName(instruction.value), kFunctionSymbol);
+            return;
+        }
+        if (instruction.op == Opcode::kJnz) {
+            EncodeJnz(instruction);
+            return;
+        }
+
+        int opcode = kOpcodes[static_cast<int>(instruction.op)];
+        if (opcode == -1) {
+            std::stringstream ss;
+            ss << "Instruction `" << GetMnemonic(instruction.op) << "` has no known encoding in object files";
+            throw std::runtime_error(ss.str());
+        }
+        code_.push_back(opcode);
+
+        switch (instruction.kind) {
+            case Operand::kNone:
+                break;
+            case Operand::kImmediate:
+                code_.push_back(kImmediateArg);
+                AppendRaw(&code_, instruction.value, 8);
+                break;
+            case Operand::kRegister:
+                code_.push_back(kRegisterArg);
+                code_.push_back(instruction.value);
+                break;
+            case Operand::kMemory:
+                code_.push_back(kMemoryArg);
+                code_.push_back(instruction.value);
+                break;
+            case Operand::kSymbol:
+                AddRelocation(std::string(module_.GetSymbolName(instruction.value)));
+                break;
+            case Operand::kLabel:
+                AddRelocation(Module::GetLabelName(instruction.value));
+                break;
+            case Operand::kLocal:
+            case Operand::kFrameSize:
+                throw std::logic_error("Frame slots must be lowered before encoding");
+        }
+    }
+
+    /* `jnz L` has no encoding, it is `jz skip; jmp L; skip:`, as both jumps leave the stack as it is */
+    void EncodeJnz(const Instruction& instruction) {
+        std::string skip = ".Ljnz" + std::to_string(skip_count_++);
+        code_.push_back(kOpcodes[static_cast<int>(Opcode::kJz)]);
+        AddRelocation(skip);
+        Instruction jump = instruction;
+        jump.op = Opcode::kJmp;
+        EncodeInstruction(jump);
+        AddSymbol(std::move(skip), kFunctionSymbol);
+    }
+
+    /* Code symbols are at the current position */
+    void AddSymbol(std::string name, SymbolType type) {
+        symbols_.push_back({std::move(name), static_cast<int64_t>(code_.size()), type});
+    }
+
+    /* The address is a number left zero, to be filled in by the linker */
+    void AddRelocation(std::string name) {
+        code_.push_back(kImmediateArg);
+        relocations_.push_back({code_.size(), std::move(name)});
+        AppendRaw(&code_, 0, 8);
+    }
+
+    const Module& module_;
+    std::vector<char> code_;
+    std::vector<Symbol> symbols_;
+    std::vector<Relocation> relocations_;
+    int64_t variables_size_ = 0;
+    int skip_count_ = 0;
+};
+
+}  /* namespace vpl */
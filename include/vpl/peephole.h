@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Rule-driven peephole optimizer. Instructions are appended one by one to the optimized code, and
+ * after each append the rules are tried on the end of it. A rule that matches replaces the window
+ * with its rewrite, which is appended the same way, so rewrites cascade. Passes repeat until one
+ * changes nothing. Labels are never part of a match, so a window is always straight-line code.
+ *
+ * The scratch register is assumed to be written before every read in the same block, so its value
+ * is dead after a rewritten window. The code generator uses the assign register this way.
+ */
+class PeepholeOptimizer {
+public:
+    explicit PeepholeOptimizer(int scratch_register) : scratch_register_(scratch_register) {}
+
+    void Run(Module* module) {
+        for (auto& function : module->GetFunctions()) {
+            Optimize(&function.code);
+        }
+    }
+
+    void Optimize(std::vector<Instruction>* code) {
+        std::vector<Instruction> optimized;
+        optimized.reserve(code->size());
+        do {
+            is_changed_ = false;
+            for (const auto& instruction : *code) {
+                Append(&optimized, instruction);
+            }
+            code->swap(optimized);
+            optimized.clear();
+        } while (is_changed_);
+    }
+
+    void PrintStats(std::ostream& out) const {
+        out << std::left << std::setw(44) << "peephole rule" << std::right << std::setw(12) << "rewrites"
+            << '\n';
+        for (size_t i = 0; i < kRuleCount; ++i) {
+            out << std::left << std::setw(44) << kRules[i].name << std::right << std::setw(12) << counts_[i]
+                << '\n';
+        }
+    }
+
+private:
+    using Window = const Instruction*;
+    using Rewrite = std::vector<Instruction>;
+
+    struct Rule {
+        const char* name;
+        size_t size;
+        bool (PeepholeOptimizer::*apply)(Window window, Rewrite* rewrite) const;
+    };
+
+    static constexpr size_t kRuleCount = 9;
+    static const Rule kRules[kRuleCount];
+
+    void Append(std::vector<Instruction>* code, const Instruction& instruction) {
+        code->push_back(instruction);
+        Rewrite rewrite;
+        for (size_t i = 0; i < kRuleCount; ++i) {
+            const Rule& rule = kRules[i];
+            if (code->size() < rule.size) {
+                continue;
+            }
+            if ((this->*rule.apply)(code->data() + code->size() - rule.size, &rewrite)) {
+                code->erase(code->end() - rule.size, code->end());
+                ++counts_[i];
+                is_changed_ = true;
+                for (const auto& replacement : rewrite) {
+                    Append(code, replacement);
+                }
+                return;
+            }
+        }
+    }
+
+    /* A push without side effects, which can be dropped if its value is unused */
+    static bool IsPlainPush(const Instruction& instruction) {
+        return instruction.op == Opcode::kPush && instruction.kind != Operand::kNone;
+    }
+
+    static bool IsDiscard(const Instruction& instruction) {
+        return Is(instruction, Opcode::kPop, Operand::kImmediate, 0);
+    }
+
+    /* `push %r; push n; add|sub; pop %r` changes %r by +-n */
+    static bool IsRegisterAdjustment(Window window, int64_t* reg, int64_t* delta) {
+        if (!Is(window[0], Opcode::kPush, Operand::kRegister) ||
+            !Is(window[1], Opcode::kPush, Operand::kImmediate) ||
+            (window[2].op != Opcode::kAdd && window[2].op != Opcode::kSub) ||
+            !Is(window[3], Opcode::kPop, Operand::kRegister, window[0].value)) {
+            return false;
+        }
+        *reg = window[0].value;
+        *delta = window[2].op == Opcode::kAdd ? window[1].value : -window[1].value;
+        return true;
+    }
+
+    /* ret; x  or  jmp L; x  ->  ret  or  jmp L, while x is not a label */
+    bool RemoveUnreachable(Window window, Rewrite* rewrite) const {
+        if ((window[0].op != Opcode::kRet && window[0].op != Opcode::kJmp) || window[1].op == Opcode::kLabel) {
+            return false;
+        }
+        *rewrite = {window[0]};
+        return true;
+    }
+
+    /* jmp L; L:  ->  L: */
+    bool RemoveJumpToNext(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kJmp, Operand::kLabel) ||
+            !Is(window[1], Opcode::kLabel, Operand::kLabel, window[0].value)) {
+            return false;
+        }
+        *rewrite = {window[1]};
+        return true;
+    }
+
+    /* push %r; pop %r  ->  nothing */
+    bool RemoveRegisterRoundTrip(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kPush, Operand::kRegister) ||
+            !Is(window[1], Opcode::kPop, Operand::kRegister, window[0].value)) {
+            return false;
+        }
+        rewrite->clear();
+        return true;
+    }
+
+    /* push x; pop 0  or  dup; pop 0  ->  nothing */
+    bool RemoveDiscardedValue(Window window, Rewrite* rewrite) const {
+        if ((!IsPlainPush(window[0]) && window[0].op != Opcode::kDup) || !IsDiscard(window[1])) {
+            return false;
+        }
+        rewrite->clear();
+        return true;
+    }
+
+    /* push 0; add  or  push 0; sub  ->  nothing */
+    bool RemoveZeroOperand(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kPush, Operand::kImmediate, 0) ||
+            (window[1].op != Opcode::kAdd && window[1].op != Opcode::kSub)) {
+            return false;
+        }
+        rewrite->clear();
+        return true;
+    }
+
+    /* push 0; push x; add  ->  push x */
+    bool RemoveZeroAddend(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kPush, Operand::kImmediate, 0) || !IsPlainPush(window[1]) ||
+            window[2].op != Opcode::kAdd) {
+            return false;
+        }
+        *rewrite = {window[1]};
+        return true;
+    }
+
+    /* Two adjustments of the same register by +-a and +-b  ->  one by a + b, or nothing */
+    bool MergeRegisterAdjustments(Window window, Rewrite* rewrite) const {
+        int64_t first_reg, first_delta, second_reg, second_delta;
+        if (!IsRegisterAdjustment(window, &first_reg, &first_delta) ||
+            !IsRegisterAdjustment(window + 4, &second_reg, &second_delta) || first_reg != second_reg) {
+            return false;
+        }
+        int64_t delta = first_delta + second_delta;
+        rewrite->clear();
+        if (delta != 0) {
+            *rewrite = {
+                window[0],
+                Instruction(Opcode::kPush, Operand::Immediate(delta > 0 ? delta : -delta)),
+                Instruction(delta > 0 ? Opcode::kAdd : Opcode::kSub, Operand()),
+                window[3],
+            };
+        }
+        return true;
+    }
+
+    /* push %r; pop %s; push !s  ->  push !r */
+    bool LoadThroughRegister(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kPush, Operand::kRegister) || window[0].value == scratch_register_ ||
+            !Is(window[1], Opcode::kPop, Operand::kRegister, scratch_register_) ||
+            !Is(window[2], Opcode::kPush, Operand::kMemory, scratch_register_)) {
+            return false;
+        }
+        *rewrite = {Instruction(Opcode::kPush, Operand::Memory(window[0].value))};
+        return true;
+    }
+
+    /* push %r; pop %s; dup; pop !s  ->  dup; pop !r */
+    bool StoreThroughRegister(Window window, Rewrite* rewrite) const {
+        if (!Is(window[0], Opcode::kPush, Operand::kRegister) || window[0].value == scratch_register_ ||
+            !Is(window[1], Opcode::kPop, Operand::kRegister, scratch_register_) || window[2].op != Opcode::kDup ||
+            !Is(window[3], Opcode::kPop, Operand::kMemory, scratch_register_)) {
+            return false;
+        }
+        *rewrite = {window[2], Instruction(Opcode::kPop, Operand::Memory(window[0].value))};
+        return true;
+    }
+
+    int scratch_register_;
+    size_t counts_[kRuleCount] = {};
+    bool is_changed_ = false;
+};
+
+inline const PeepholeOptimizer::Rule PeepholeOptimizer::kRules[kRuleCount] = {
+    {"unreachable code after ret or jmp", 2, &PeepholeOptimizer::RemoveUnreachable},
+    {"jmp to the next label", 2, &PeepholeOptimizer::RemoveJumpToNext},
+    {"push %r; pop %r", 2, &PeepholeOptimizer::RemoveRegisterRoundTrip},
+    {"push or dup; pop 0", 2, &PeepholeOptimizer::RemoveDiscardedValue},
+    {"push 0; add or sub", 2, &PeepholeOptimizer::RemoveZeroOperand},
+    {"push 0; push x; add", 3, &PeepholeOptimizer::RemoveZeroAddend},
+    {"two adjustments of a register", 8, &PeepholeOptimizer::MergeRegisterAdjustments},
+    {"push %r; pop %s; push !s", 3, &PeepholeOptimizer::LoadThroughRegister},
+    {"push %r; pop %s; dup; pop !s", 4, &PeepholeOptimizer::StoreThroughRegister},
+};
+
+}  /* namespace vpl */
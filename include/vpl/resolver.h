@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "symbol_table.h"
+#include "vpl/instruction.h"
+
+namespace vpl {
+
+/* Where a variable lives: at an offset from the frame base %1, or at its name if global */
+struct VariableSlot {
+    bool is_global = false;
+    int offset = 0;
+    int symbol = -1;
+};
+
+struct FunctionInfo {
+    int symbol;
+    int arg_count;
+    bool is_defined = false;
+    bool is_inline = false;
+    bool has_tail_call = false;
+    /* The slot summing up `return x op f(...)` of the recursion, see AddAccumulatingCall */
+    int accumulator_slot = -1;
+    Opcode accumulator_op = Opcode::kAdd;
+};
+
+/*
+ * Name resolution pass, run over the tree before code generation. It binds every use of a name to
+ * its variable slot or function, and the nodes keep the result, so that codegen does no lookups.
+ *
+ * Locals of a function get consecutive frame offsets, arguments first. A block's offsets are freed
+ * when it closes, so sibling blocks share them. Names are indexed by symbol id.
+ */
+class Resolver {
+public:
+    explicit Resolver(const SymbolTable& symbols)
+        : symbols_(symbols), bindings_(symbols.Size()), function_of_symbol_(symbols.Size(), -1) {}
+
+    const SymbolTable& GetSymbols() const {
+        return symbols_;
+    }
+
+    void DeclareFunction(int symbol, bool is_inline) {
+        last_symbol_ = symbol;
+        last_is_inline_ = is_inline;
+        last_args_.clear();
+    }
+
+    void AddArgument(int symbol) {
+        last_args_.push_back(symbol);
+    }
+
+    int EndFunctionDeclaration() {
+        int& function = function_of_symbol_[last_symbol_];
+        if (function == -1) {
+            function = functions_.size();
+            functions_.push_back({last_symbol_, static_cast<int>(last_args_.size())});
+        } else if (functions_[function].arg_count != static_cast<int>(last_args_.size())) {
+            std::stringstream ss;
+            ss << "Function `" << symbols_.GetName(last_symbol_) << "` already has another signature";
+            throw std::runtime_error(ss.str());
+        }
+        functions_[function].is_inline |= last_is_inline_;
+        return function;
+    }
+
+    /* Opens the scope of the last declared function, with its arguments at offsets 0, 1, ... */
+    int BeginFunction() {
+        OpenScope();
+        max_frame_size_ = frame_size_;
+        for (int arg : last_args_) {
+            CreateVariable(arg);
+        }
+        current_function_ = function_of_symbol_[last_symbol_];
+        functions_[current_function_].is_defined = true;
+        accumulator_state_ = kNoAccumulator;
+        return current_function_;
+    }
+
+    /* A function with accumulating calls gets a slot above all of its locals for the accumulator */
+    void EndFunction() {
+        CloseScope();
+        if (accumulator_state_ == kHasAccumulator) {
+            functions_[current_function_].accumulator_slot = max_frame_size_;
+        }
+        current_function_ = -1;
+    }
+
+    int GetCurrentFunction() const {
+        return current_function_;
+    }
+
+    /* `return f(...)` in the body of f */
+    void AddTailCall() {
+        functions_[current_function_].has_tail_call = true;
+    }
+
+    /*
+     * `return x op f(...)` in the body of f, where op is associative and commutative, can be turned
+     * into `acc = acc op x` and a tail call, if every such return of the function has the same op.
+     */
+    void AddAccumulatingCall(Opcode op) {
+        FunctionInfo& info = functions_[current_function_];
+        if (accumulator_state_ == kNoAccumulator) {
+            accumulator_state_ = kHasAccumulator;
+            info.accumulator_op = op;
+        } else if (info.accumulator_op != op) {
+            accumulator_state_ = kMixedAccumulators;
+        }
+        info.has_tail_call = true;
+    }
+
+    void OpenScope() {
+        scope_starts_.push_back(declared_.size());
+    }
+
+    void CloseScope() {
+        while (declared_.size() > scope_starts_.back()) {
+            bindings_[declared_.back()].pop_back();
+            declared_.pop_back();
+            --frame_size_;
+        }
+        scope_starts_.pop_back();
+    }
+
+    VariableSlot CreateVariable(int symbol) {
+        auto& bindings = bindings_[symbol];
+        if (!bindings.empty() && bindings.back().depth == scope_starts_.size()) {
+            std::stringstream ss;
+            ss << "Variable `" << symbols_.GetName(symbol) << "` already exists";
+            throw std::runtime_error(ss.str());
+        }
+        VariableSlot slot;
+        if (scope_starts_.empty()) {
+            slot.is_global = true;
+            slot.symbol = symbol;
+            globals_.push_back(symbol);
+        } else {
+            slot.offset = frame_size_++;
+            max_frame_size_ = std::max(max_frame_size_, frame_size_);
+            declared_.push_back(symbol);
+        }
+        bindings.push_back({slot, scope_starts_.size()});
+        return slot;
+    }
+
+    const VariableSlot& FindVariable(int symbol) const {
+        if (bindings_[symbol].empty()) {
+            std::stringstream ss;
+            ss << "Undefined variable `" << symbols_.GetName(symbol) << '`';
+            throw std::runtime_error(ss.str());
+        }
+        return bindings_[symbol].back().slot;
+    }
+
+    int FindFunction(int symbol) const {
+        if (function_of_symbol_[symbol] == -1) {
+            std::stringstream ss;
+            ss << "Undefined function `" << symbols_.GetName(symbol) << '`';
+            throw std::runtime_error(ss.str());
+        }
+        return function_of_symbol_[symbol];
+    }
+
+    void CheckArgCnt(int function, size_t arg_cnt) const {
+        if (arg_cnt != static_cast<size_t>(functions_[function].arg_count)) {
+            std::stringstream ss;
+            ss << "Wrong number of arguments: expected " << functions_[function].arg_count << ", got " << arg_cnt;
+            throw std::runtime_error(ss.str());
+        }
+    }
+
+    /* Number of frame slots in use: a callee's frame starts right after them */
+    int FrameSize() const {
+        return frame_size_;
+    }
+
+    const FunctionInfo& GetFunction(int function) const {
+        return functions_[function];
+    }
+
+    const std::vector<int>& GetGlobals() const {
+        return globals_;
+    }
+
+private:
+    enum AccumulatorState {
+        kNoAccumulator,
+        kHasAccumulator,
+        kMixedAccumulators,
+    };
+
+    struct Binding {
+        VariableSlot slot;
+        size_t depth;
+    };
+
+    const SymbolTable& symbols_;
+    std::vector<std::vector<Binding>> bindings_;
+    std::vector<int> declared_;
+    std::vector<size_t> scope_starts_;
+    int frame_size_ = 0;
+    int max_frame_size_ = 0;
+    int current_function_ = -1;
+    AccumulatorState accumulator_state_ = kNoAccumulator;
+
+    std::vector<FunctionInfo> functions_;
+    std::vector<int> function_of_symbol_;
+    std::vector<int> globals_;
+    int last_symbol_ = -1;
+    bool last_is_inline_ = false;
+    std::vector<int> last_args_;
+};
+
+}  /* namespace vpl */
@@ -1,96 +1,25 @@
 #pragma once
 
-#include <string>
+#include <algorithm>
 #include <stdexcept>
-#include <sstream>
 #include <vector>
-#include <unordered_map>
 
-#define LOG out_ << '#' << __PRETTY_FUNCTION__ << '\n';
+#include "vpl/module.h"
+#include "vpl/resolver.h"
 
 namespace vpl {
 
-class Function {
-public:
-    explicit Function(const std::string& name) : name_(name) {}
-
-    const std::vector<std::string>& GetArgs() const {
-        return args_;
-    }
-
-    void AddArgument(const std::string& name) {
-        args_.push_back(name);
-    }
-
-    const std::string& GetName() const {
-        return name_;
-    }
-
-    bool AreEquivalent(const Function& other) const {
-        return name_ == other.name_ && args_.size() == other.args_.size();
-    }
-
-private:
-    std::vector<std::string> args_;
-    std::string name_;
-};
-
-class NameScope {
-public:
-    void AddVariable(const std::string& name) {
-        if (Contains(name)) {
-            std::stringstream ss;
-            ss << "Variable `" << name << "` already exists";
-            throw std::runtime_error(ss.str());
-        }
-        offsets_[name] = total_size_;
-        ++total_size_;
-    }
-
-    int Size() const {
-        return total_size_;
-    }
-
-    bool IsGlobal() const {
-        return is_global_;
-    }
-
-    void SetGlobal(bool value) {
-        is_global_ = value;
-    }
-
-    bool Contains(const std::string& name) const {
-        return offsets_.find(name) != offsets_.end();
-    }
-
-    int GetOffset(const std::string& name) const {
-        return offsets_.find(name)->second;
-    }
-
-    const std::unordered_map<std::string, int> GetOffsets() const {
-        return offsets_;
-    }
-
-private:
-    int total_size_ = 0;
-    std::unordered_map<std::string, int> offsets_;
-    bool is_global_ = false;
-};
-
+/*
+ * Code generation context. Names are already bound by the Resolver, so it only emits the code for
+ * their slots into the module and tracks the operand stack.
+ */
 class Scope {
 public:
-    explicit Scope(std::ostream& out) : out_(out), scopes_(1) {
-        scopes_.back().SetGlobal(true);
-    }
+    Scope(Module& out, const Resolver& resolver) : resolver_(resolver), out_(out) {}
 
     void Finish() {
-        LOG
-        for (size_t i = 0; i < scopes_.size(); ++i) {
-            if (scopes_[i].IsGlobal()) {
-                for (const auto& [name, offset] : scopes_[i].GetOffsets()) {
-                    out_ << "    var " << name << " 1\n";
-                }
-            }
+        for (int symbol : resolver_.GetGlobals()) {
+            out_.AddVariable(symbol, 1);
         }
     }
 
@@ -98,27 +27,30 @@ public:
         return ++unique_id_;
     }
 
-    int GetPreviousUnique() const {
-        return unique_id_;
+    /* Loops being built, innermost last: `break` jumps to the end label of the innermost */
+    void BeginLoop(int unique_id) {
+        loops_.push_back(unique_id);
     }
 
-    const std::string& GetLastFunctionName() const {
-        return functions_.back().GetName();
+    void EndLoop() {
+        loops_.pop_back();
     }
 
-    void SpawnFunctionScope() {
-        OpenScope();
-        for (const auto& arg : functions_.back().GetArgs()) {
-            scopes_.back().AddVariable(arg);
+    Operand GetBreakTarget() const {
+        if (loops_.empty()) {
+            throw std::runtime_error("`break` is not in a loop");
         }
+        return Operand::Label(loops_.back(), LabelKind::kEnd);
     }
 
-    void OpenScope() {
-        scopes_.emplace_back();
+    int GetFunctionSymbol(int function) const {
+        return resolver_.GetFunction(function).symbol;
     }
 
-    void CloseScope() {
-        scopes_.pop_back();
+    /* Functions defined in this module take their first arguments in registers, others take none */
+    int GetRegisterArgCount(int function) const {
+        const FunctionInfo& info = resolver_.GetFunction(function);
+        return info.is_defined ? std::min(info.arg_count, ArgRegisterCount()) : 0;
     }
 
     void SaveStackPos() {
@@ -142,119 +74,168 @@ public:
         return 1;
     }
 
-    void CreateVariable(const std::string& name) {
-        scopes_.back().AddVariable(name);
+    /*
+     * Registers above the fixed ones, which FrameLowering keeps locals in. They are saved by the
+     * callee, so a call leaves them intact. The assign register and the argument registers are
+     * clobbered by any call, and the caller moves the stack pointer to the callee's frame and back.
+     */
+    int FirstSpareRegister() const {
+        return 4;
+    }
+
+    int SpareRegisterCount() const {
+        return 4;
+    }
+
+    int FirstArgRegister() const {
+        return 8;
     }
 
-    void DeclareFunction(const std::string& name) {
-        functions_.emplace_back(name);
+    int ArgRegisterCount() const {
+        return 4;
+    }
+
+    /* Locals are left as frame slots for FrameLowering, globals are loaded through their address */
+    void LoadVariable(const VariableSlot& slot) {
+        if (!slot.is_global) {
+            out_.Emit(Opcode::kPush, Operand::Local(slot.offset));
+        } else {
+            out_.Emit(Opcode::kPush, Operand::Symbol(slot.symbol));
+            out_.Emit(Opcode::kPop, Operand::Register(AssignRegister()));
+            out_.Emit(Opcode::kPush, Operand::Memory(AssignRegister()));
+        }
+        Push();
     }
 
-    void EndFunctionDeclaration() {
-        const auto& name = functions_.back().GetName();
-        auto iter = func_name_map_.find(name);
-        if (iter == func_name_map_.end()) {
-            func_name_map_[name] = functions_.size() - 1;
-            return;
+    /* Pops the top of the stack into the variable */
+    void StoreVariable(const VariableSlot& slot) {
+        if (!slot.is_global) {
+            out_.Emit(Opcode::kPop, Operand::Local(slot.offset));
+        } else {
+            out_.Emit(Opcode::kPush, Operand::Symbol(slot.symbol));
+            out_.Emit(Opcode::kPop, Operand::Register(AssignRegister()));
+            out_.Emit(Opcode::kPop, Operand::Memory(AssignRegister()));
         }
-        if (!functions_.back().AreEquivalent(functions_[iter->second])) {
-            std::stringstream ss;
-            ss << "Function `" << name << "` already has another signature";
-            throw std::runtime_error(ss.str());
+        Pop();
+    }
+
+    /*
+     * Starts the code of a function by moving its register arguments to their frame slots. Then the
+     * accumulator is set to the identity of its operation, and the entry label is where tail calls
+     * jump to.
+     */
+    void BeginFunction(int function) {
+        const FunctionInfo& info = resolver_.GetFunction(function);
+        int register_arg_count = GetRegisterArgCount(function);
+        current_function_ = function;
+        cur_stack_pos_ = 0;
+        out_.BeginFunction(info.symbol, info.arg_count, register_arg_count, info.is_inline);
+        for (int i = 0; i < register_arg_count; ++i) {
+            out_.Emit(Opcode::kPush, Operand::Register(FirstArgRegister() + i));
+            out_.Emit(Opcode::kPop, Operand::Local(i));
+        }
+        if (info.accumulator_slot != -1) {
+            out_.Emit(Opcode::kPush, Operand::Immediate(info.accumulator_op == Opcode::kMul ? 1 : 0));
+            out_.Emit(Opcode::kPop, Operand::Local(info.accumulator_slot));
+        }
+        if (info.has_tail_call) {
+            entry_unique_id_ = GetUnique();
+            out_.Label(entry_unique_id_, LabelKind::kEntry);
         }
     }
 
-    void AddArgumentName(const std::string& name) {
-        functions_.back().AddArgument(name);
+    int GetCurrentFunction() const {
+        return current_function_;
     }
 
-    void LoadVariableAddr(const std::string& name) {
-        LOG
-        for (auto iter = scopes_.rbegin(); iter != scopes_.rend(); ++iter) {
-            if (iter->Contains(name)) {
-                if (!iter->IsGlobal()) {
-                    out_ << "    push " << iter->GetOffset(name) << '\n';
-                    out_ << "    push %" << StackPointerRegister() << '\n';
-                    out_ << "    add\n";
-                } else {
-                    out_ << "    push " << name << '\n';
-                }
-                ++cur_stack_pos_;
-                return;
-            }
-        }
-        std::stringstream ss;
-        ss << "Undefined variable `" << name << '`';
-        throw std::runtime_error(ss.str());
+    bool HasAccumulator(Opcode op) const {
+        const FunctionInfo& info = resolver_.GetFunction(current_function_);
+        return info.accumulator_slot != -1 && info.accumulator_op == op;
     }
 
-    void LoadVariable(const std::string& name) {
-        LOG
-        LoadVariableAddr(name);
-        out_ << "    pop %" << AssignRegister() << '\n';
-        out_ << "    push !" << AssignRegister() << '\n';
+    /* acc = acc op top, for `return x op f(...)` */
+    void Accumulate() {
+        const FunctionInfo& info = resolver_.GetFunction(current_function_);
+        out_.Emit(Opcode::kPush, Operand::Local(info.accumulator_slot));
+        out_.Emit(info.accumulator_op);
+        out_.Emit(Opcode::kPop, Operand::Local(info.accumulator_slot));
+        Pop();
     }
 
-    void PrepareFunction(const std::string& name) {
-        LOG
-        auto iter = func_name_map_.find(name);
-        if (iter == func_name_map_.end()) {
-            std::stringstream ss;
-            ss << "Undefined function `" << name << '`';
-            throw std::runtime_error(ss.str());
+    /* Pops the return value into the return register and returns, adding the accumulator if any */
+    void Return() {
+        const FunctionInfo& info = resolver_.GetFunction(current_function_);
+        if (info.accumulator_slot != -1) {
+            out_.Emit(Opcode::kPush, Operand::Local(info.accumulator_slot));
+            out_.Emit(info.accumulator_op);
         }
-        cur_func_ptr_ = &functions_[iter->second];
-        out_ << "    push %" << StackPointerRegister() << '\n';
-        Push();
+        out_.Emit(Opcode::kPop, Operand::Register(RetRegister()));
+        Pop();
+        out_.Emit(Opcode::kRet);
     }
 
-    void CheckArgCnt(size_t arg_cnt) {
-        if (cur_func_ptr_ == nullptr) {
-            throw std::runtime_error("Function is not prepared!");
+    /* A call of the current function as its last action: the arguments are stored over its own */
+    void TailCall() {
+        int arg_count = resolver_.GetFunction(current_function_).arg_count;
+        for (int i = 0; i < arg_count; ++i) {
+            out_.Emit(Opcode::kPop, Operand::Local(i));
+            Pop();
         }
-        if (arg_cnt != cur_func_ptr_->GetArgs().size()) {
-            std::stringstream ss;
-            ss << "Wrong number of arguments: expected " << cur_func_ptr_->GetArgs().size() << ", got " << arg_cnt;
-            throw std::runtime_error(ss.str());
+        out_.Emit(Opcode::kJmp, Operand::Label(entry_unique_id_, LabelKind::kEntry));
+    }
+
+    /*
+     * The arguments are on the stack, the first on top. The first ones go to the argument registers,
+     * the stack pointer is moved once to the callee's frame, right after the caller's, and the rest
+     * are stored at their offsets from it. The frame size is left to FrameLowering, which knows it
+     * once per function: it is zero if the slots are all in registers, and then the stack pointer is
+     * not moved at all. Until then it counts the slots in use, where the Inliner puts the callee's.
+     */
+    void CallFunction(int function, int frame_size) {
+        /* The accumulator is above every other slot, and stays live across calls */
+        int accumulator_slot = resolver_.GetFunction(current_function_).accumulator_slot;
+        frame_size = std::max(frame_size, accumulator_slot + 1);
+
+        int arg_count = resolver_.GetFunction(function).arg_count;
+        int register_arg_count = GetRegisterArgCount(function);
+        Operand stack_pointer = Operand::Register(StackPointerRegister());
+
+        for (int i = 0; i < register_arg_count; ++i) {
+            out_.Emit(Opcode::kPop, Operand::Register(FirstArgRegister() + i));
+            Pop();
         }
-    }
-
-    void CallFunction(const std::string& name) {
-        LOG
-        Function* func = &functions_[func_name_map_[name]];
 
-        int frame_size = 0;
-        for (size_t i = 0; i < scopes_.size(); ++i) {
-            if (!scopes_[i].IsGlobal()) {
-                frame_size += scopes_[i].Size();
+        out_.Emit(Opcode::kPush, Operand::FrameSize(frame_size));
+        out_.Emit(Opcode::kPush, stack_pointer);
+        out_.Emit(Opcode::kAdd);
+        out_.Emit(Opcode::kPop, stack_pointer);
+        for (int i = register_arg_count; i < arg_count; ++i) {
+            if (i != 0) {
+                out_.Emit(Opcode::kPush, Operand::Immediate(i));
+                out_.Emit(Opcode::kPush, stack_pointer);
+                out_.Emit(Opcode::kAdd);
+                out_.Emit(Opcode::kPop, Operand::Register(AssignRegister()));
             }
-        }
-
-        out_ << "    push " << frame_size << '\n';
-        out_ << "    push %" << StackPointerRegister() << '\n';
-        out_ << "    add\n";
-        out_ << "    pop %" << StackPointerRegister() << '\n';
-
-        for (size_t i = 0; i < func->GetArgs().size(); ++i) {
-            out_ << "    pop !" << StackPointerRegister() << '\n';
-            out_ << "    push %" << StackPointerRegister() << '\n';
-            out_ << "    push 1\n";
-            out_ << "    add\n";
-            out_ << "    pop %" << StackPointerRegister() << '\n';
+            out_.Emit(Opcode::kPop, Operand::Memory(i != 0 ? AssignRegister() : StackPointerRegister()));
             Pop();
         }
-        out_ << "    push %" << StackPointerRegister() << '\n';
-        out_ << "    push " << func->GetArgs().size() << "\n";
-        out_ << "    sub\n";
-        out_ << "    pop %" << StackPointerRegister() << '\n';
-
-        out_ << "    call " << name << '\n';
-        out_ << "    pop %" << StackPointerRegister() << '\n';
-        out_ << "    push %" << RetRegister() << '\n';
+
+        out_.Emit(Opcode::kCall, Operand::Symbol(GetFunctionSymbol(function)));
+        out_.Emit(Opcode::kPush, stack_pointer);
+        out_.Emit(Opcode::kPush, Operand::FrameSize(frame_size));
+        out_.Emit(Opcode::kSub);
+        out_.Emit(Opcode::kPop, stack_pointer);
+        out_.Emit(Opcode::kPush, Operand::Register(RetRegister()));
+        Push();
     }
 
+    /* Counts a word pushed on the operand stack, keeping the deepest count of the function */
     void Push() {
         ++cur_stack_pos_;
+        auto& functions = out_.GetFunctions();
+        if (!functions.empty()) {
+            functions.back().max_stack_depth = std::max(functions.back().max_stack_depth, cur_stack_pos_);
+        }
     }
 
     void Pop() {
@@ -262,14 +243,14 @@ public:
     }
 
 private:
+    const Resolver& resolver_;
     int unique_id_ = 0;
-    std::vector<Function> functions_;
-    std::vector<NameScope> scopes_;
+    int current_function_ = -1;
+    int entry_unique_id_ = -1;
+    std::vector<int> loops_;
     int cur_stack_pos_ = 0;
     std::vector<int> stack_pos_hist_;
-    Function* cur_func_ptr_ = nullptr;
-    std::unordered_map<std::string, int> func_name_map_;
-    std::ostream& out_;
+    Module& out_;
 };
 
 }  /* namespace vpl */
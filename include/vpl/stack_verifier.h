@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Proves that the operand stack of every function is balanced, by following its code along every
+ * path with the number of words on the stack. Each label must be reached with the same depth from
+ * every jump and from the code before it, no instruction may take more words than there are, and a
+ * function returns with its stack empty, as it began. Code that no path reaches is not checked. A
+ * failure is a bug of the code generator or of a pass after it.
+ *
+ * The deepest stack of each function is recorded in Module::Function::max_stack_depth, so a VM that
+ * trusts the object file may preallocate it and drop its per-instruction checks.
+ */
+class StackVerifier {
+public:
+    void Run(Module* module) {
+        module_ = module;
+        for (auto& function : module->GetFunctions()) {
+            Verify(&function);
+        }
+    }
+
+    void Verify(Module::Function* function) {
+        const std::vector<Instruction>& code = function->code;
+        std::unordered_map<int64_t, size_t> label_pos;
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].op == Opcode::kLabel) {
+                label_pos[code[i].value] = i;
+            }
+        }
+
+        function_ = function;
+        std::vector<int> depths(code.size(), -1);
+        std::vector<std::pair<size_t, int>> pending = {{0, 0}};
+        int max_depth = 0;
+        while (!pending.empty()) {
+            auto [pos, depth] = pending.back();
+            pending.pop_back();
+            for (; pos < code.size(); ++pos) {
+                if (depths[pos] != -1) {
+                    if (depths[pos] != depth) {
+                        Fail(pos, "is reached with " + std::to_string(depth) +
+                                  " words on the stack and with " + std::to_string(depths[pos]));
+                    }
+                    break;
+                }
+                depths[pos] = depth;
+
+                const Instruction& instruction = code[pos];
+                auto [taken, pushed] = GetStackEffect(instruction.op);
+                if (depth < taken) {
+                    Fail(pos, "takes " + std::to_string(taken) + " words from a stack of " +
+                                  std::to_string(depth));
+                }
+                depth += pushed - taken;
+                max_depth = std::max(max_depth, depth);
+
+                if (instruction.op == Opcode::kRet) {
+                    if (depth != 0) {
+                        Fail(pos, "returns with " + std::to_string(depth) + " words on the stack");
+                    }
+                    break;
+                }
+                if (instruction.op == Opcode::kJmp || instruction.op == Opcode::kJz ||
+                    instruction.op == Opcode::kJnz) {
+                    auto iter = label_pos.find(instruction.value);
+                    if (instruction.kind != Operand::kLabel || iter == label_pos.end()) {
+                        Fail(pos, "jumps out of the function");
+                    }
+                    pending.emplace_back(iter->second, depth);
+                    if (instruction.op == Opcode::kJmp) {
+                        break;
+                    }
+                }
+            }
+            if (pos == code.size()) {
+                Fail(pos, "falls off the end of the function");
+            }
+        }
+        function->max_stack_depth = max_depth;
+    }
+
+private:
+    /* Words an instruction takes from the stack and pushes on it */
+    static std::pair<int, int> GetStackEffect(Opcode op) {
+        switch (op) {
+            case Opcode::kPush:
+                return {0, 1};
+            case Opcode::kPop:
+                return {1, 0};
+            case Opcode::kDup:
+                return {1, 2};
+            case Opcode::kNeg:
+            case Opcode::kNot:
+            case Opcode::kBool:
+            case Opcode::kJz:
+            case Opcode::kJnz:
+                return {1, 1};
+            case Opcode::kJmp:
+            case Opcode::kCall:
+            case Opcode::kRet:
+            case Opcode::kLabel:
+                return {0, 0};
+            default:
+                return {2, 1};
+        }
+    }
+
+    [[noreturn]] void Fail(size_t pos, const std::string& what) const {
+        std::stringstream ss;
+        ss << "Operand stack check failed: instruction " << pos << " of `"
+           << module_->GetSymbolName(function_->symbol) << "` " << what;
+        throw std::logic_error(ss.str());
+    }
+
+    const Module* module_ = nullptr;
+    const Module::Function* function_ = nullptr;
+};
+
+}  /* namespace vpl */
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+#include "vpl/cost_table.h"
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Replaces `push c; mul|div|mod` with shifts, masks and additions when the cost table says they are
+ * cheaper. Multiplication uses a shift for a power of two and `dup`, a shift and an add or a sub for
+ * a sum or a difference of two. Division and modulo by a power of two round toward zero like `div`
+ * and `mod`: a negative dividend is biased by the divisor minus one before the shift, which takes
+ * its sign bit, so `shr` must be an arithmetic shift.
+ */
+class StrengthReducer {
+public:
+    explicit StrengthReducer(const CostTable& costs) : costs_(costs) {}
+
+    void Run(Module* module) {
+        for (auto& function : module->GetFunctions()) {
+            Reduce(&function.code);
+        }
+    }
+
+    void Reduce(std::vector<Instruction>* code) {
+        std::vector<Instruction> reduced;
+        reduced.reserve(code->size());
+        std::vector<Instruction> replacement;
+        for (const auto& instruction : *code) {
+            size_t kind = GetKind(instruction.op);
+            if (kind == kKindCount || reduced.empty() || reduced.back().op != Opcode::kPush ||
+                reduced.back().kind != Operand::kImmediate) {
+                reduced.push_back(instruction);
+                continue;
+            }
+            int64_t constant = reduced.back().value;
+            if (!GetReplacement(instruction.op, constant, &replacement)) {
+                reduced.push_back(instruction);
+                continue;
+            }
+            reduced.pop_back();
+            reduced.insert(reduced.end(), replacement.begin(), replacement.end());
+            ++counts_[kind];
+        }
+        code->swap(reduced);
+    }
+
+    void PrintStats(std::ostream& out) const {
+        static const char* const kNames[kKindCount] = {
+            "mul by constant", "div by constant", "mod by constant",
+        };
+        out << std::left << std::setw(44) << "strength reduction" << std::right << std::setw(12)
+            << "rewrites" << '\n';
+        for (size_t i = 0; i < kKindCount; ++i) {
+            out << std::left << std::setw(44) << kNames[i] << std::right << std::setw(12) << counts_[i]
+                << '\n';
+        }
+    }
+
+private:
+    using Sequence = std::vector<Instruction>;
+
+    static constexpr size_t kKindCount = 3;
+
+    static size_t GetKind(Opcode op) {
+        switch (op) {
+            case Opcode::kMul:
+                return 0;
+            case Opcode::kDiv:
+                return 1;
+            case Opcode::kMod:
+                return 2;
+            default:
+                return kKindCount;
+        }
+    }
+
+    static Instruction Make(Opcode op) {
+        return Instruction(op, Operand());
+    }
+
+    static Instruction Push(int64_t value) {
+        return Instruction(Opcode::kPush, Operand::Immediate(value));
+    }
+
+    static int GetLog2(uint64_t power) {
+        int log = 0;
+        while (power > 1) {
+            power >>= 1;
+            ++log;
+        }
+        return log;
+    }
+
+    static bool IsPowerOf2(uint64_t value) {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+
+    /* `push shift; shl`, nothing for a zero shift */
+    static void AppendShift(Sequence* sequence, int shift) {
+        if (shift != 0) {
+            sequence->push_back(Push(shift));
+            sequence->push_back(Make(Opcode::kShl));
+        }
+    }
+
+    /* The cheapest sequence that replaces `push constant; op`, if it is cheaper */
+    bool GetReplacement(Opcode op, int64_t constant, Sequence* best) const {
+        std::vector<Sequence> candidates;
+        switch (op) {
+            case Opcode::kMul:
+                GetMultiplications(constant, &candidates);
+                break;
+            case Opcode::kDiv:
+                GetDivisions(constant, &candidates);
+                break;
+            default:
+                GetRemainders(constant, &candidates);
+                break;
+        }
+
+        int best_cost = costs_.GetCost(Opcode::kPush) + costs_.GetCost(op);
+        bool is_found = false;
+        for (auto& candidate : candidates) {
+            int cost = costs_.GetCost(candidate);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best->swap(candidate);
+                is_found = true;
+            }
+        }
+        return is_found;
+    }
+
+    static void GetMultiplications(int64_t constant, std::vector<Sequence>* candidates) {
+        if (constant == 0) {
+            candidates->push_back({Instruction(Opcode::kPop, Operand::Immediate(0)), Push(0)});
+            return;
+        }
+        bool is_negative = constant < 0;
+        uint64_t magnitude = is_negative ? -static_cast<uint64_t>(constant) : constant;
+        uint64_t low = magnitude & -magnitude;
+        int low_shift = GetLog2(low);
+
+        if (IsPowerOf2(magnitude)) {
+            Sequence sequence;
+            AppendShift(&sequence, low_shift);
+            if (is_negative) {
+                sequence.push_back(Make(Opcode::kNeg));
+            }
+            candidates->push_back(sequence);
+            return;
+        }
+
+        /* 2^a + 2^b: x + (x << a - b), shifted by b */
+        uint64_t high = magnitude - low;
+        if (IsPowerOf2(high)) {
+            Sequence sequence = {Make(Opcode::kDup), Push(GetLog2(high) - low_shift), Make(Opcode::kShl),
+                                 Make(Opcode::kAdd)};
+            AppendShift(&sequence, low_shift);
+            if (is_negative) {
+                sequence.push_back(Make(Opcode::kNeg));
+            }
+            candidates->push_back(sequence);
+        }
+
+        /* 2^a - 2^b: x - (x << a - b) is the product negated, shifted by b */
+        uint64_t sum = magnitude + low;
+        if (IsPowerOf2(sum)) {
+            Sequence sequence = {Make(Opcode::kDup), Push(GetLog2(sum) - low_shift), Make(Opcode::kShl),
+                                 Make(Opcode::kSub)};
+            AppendShift(&sequence, low_shift);
+            if (!is_negative) {
+                sequence.push_back(Make(Opcode::kNeg));
+            }
+            candidates->push_back(sequence);
+        }
+    }
+
+    /* x + ((x >> 63) & (2^k - 1)): a negative x is biased by 2^k - 1 */
+    static Sequence GetBiased(int shift) {
+        if (shift == 1) {
+            return {Make(Opcode::kDup), Push(63), Make(Opcode::kShr), Make(Opcode::kSub)};
+        }
+        return {Make(Opcode::kDup), Push(63), Make(Opcode::kShr), Push((int64_t{1} << shift) - 1),
+                Make(Opcode::kAnd), Make(Opcode::kAdd)};
+    }
+
+    static bool GetPowerOf2Divisor(int64_t constant, int* shift) {
+        if (constant == std::numeric_limits<int64_t>::min()) {
+            return false;
+        }
+        uint64_t magnitude = constant < 0 ? -static_cast<uint64_t>(constant) : constant;
+        if (magnitude < 2 || !IsPowerOf2(magnitude)) {
+            return false;
+        }
+        *shift = GetLog2(magnitude);
+        return true;
+    }
+
+    static void GetDivisions(int64_t constant, std::vector<Sequence>* candidates) {
+        if (constant == 1) {
+            candidates->push_back({});
+            return;
+        }
+        int shift = 0;
+        if (!GetPowerOf2Divisor(constant, &shift)) {
+            return;
+        }
+        Sequence sequence = GetBiased(shift);
+        sequence.push_back(Push(shift));
+        sequence.push_back(Make(Opcode::kShr));
+        if (constant < 0) {
+            sequence.push_back(Make(Opcode::kNeg));
+        }
+        candidates->push_back(sequence);
+    }
+
+    /* x - (biased x & -2^k), the remainder has the sign of x like `mod` */
+    static void GetRemainders(int64_t constant, std::vector<Sequence>* candidates) {
+        if (constant == 1 || constant == -1) {
+            candidates->push_back({Instruction(Opcode::kPop, Operand::Immediate(0)), Push(0)});
+            return;
+        }
+        int shift = 0;
+        if (!GetPowerOf2Divisor(constant, &shift)) {
+            return;
+        }
+        Sequence sequence = {Make(Opcode::kDup)};
+        Sequence biased = GetBiased(shift);
+        sequence.insert(sequence.end(), biased.begin(), biased.end());
+        sequence.push_back(Push(-(int64_t{1} << shift)));
+        sequence.push_back(Make(Opcode::kAnd));
+        sequence.push_back(Make(Opcode::kSub));
+        candidates->push_back(sequence);
+    }
+
+    const CostTable& costs_;
+    size_t counts_[kKindCount] = {};
+};
+
+}  /* namespace vpl */
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <tuple>
+#include <vector>
+
+#include "vpl/cost_table.h"
+#include "vpl/fold.h"
+#include "vpl/module.h"
+
+namespace vpl {
+
+/*
+ * Computes a repeated pure subexpression once. The code of each function is run on a model of the
+ * operand stack that gives every word a value number: the same operation on the same numbers makes
+ * the same number, and a store to a local starts a new version of it. Numbers are kept only up to
+ * the next label, where other paths join. The code computing a word is the span of instructions
+ * since its first operand was pushed, and a repeated span made only of pushes of constants and
+ * locals, `dup` and operators is replaced by the value the first span computed.
+ *
+ * The value is kept with `dup` when it is needed right after it was computed, or else stored by
+ * `dup; pop tmp` into a new slot and loaded by `push tmp`. The cost table chooses between both and
+ * recomputing, a slot being costed as if it stayed in memory, with its address computed at each
+ * access, since FrameLowering gives registers only to the slots worth most. Larger values are taken
+ * first, so a reused value takes its parts with it.
+ */
+class ValueNumbering {
+public:
+    explicit ValueNumbering(const CostTable& costs) : costs_(costs) {}
+
+    void Run(Module* module) {
+        for (auto& function : module->GetFunctions()) {
+            Number(&function);
+        }
+    }
+
+    void Number(Module::Function* function) {
+        std::vector<Instruction>& code = function->code;
+        std::vector<std::vector<Span>> spans = GetSpans(code);
+
+        /* Values by the length of their longest span, longest first */
+        std::vector<size_t> values;
+        for (size_t value = 0; value < spans.size(); ++value) {
+            if (spans[value].size() >= 2) {
+                values.push_back(value);
+            }
+        }
+        auto get_length = [&spans](size_t value) {
+            size_t length = 0;
+            for (const auto& span : spans[value]) {
+                length = std::max(length, span.end - span.begin);
+            }
+            return length;
+        };
+        std::stable_sort(values.begin(), values.end(), [&get_length](size_t lhs, size_t rhs) {
+            return get_length(lhs) > get_length(rhs);
+        });
+
+        int64_t next_slot = function->arg_count;
+        for (const auto& instruction : code) {
+            if (instruction.kind == Operand::kLocal) {
+                next_slot = std::max(next_slot, instruction.value + 1);
+            }
+        }
+
+        std::vector<State> states(code.size(), kKept);
+        std::map<size_t, Replacement> replacements;
+        std::map<size_t, int64_t> stores;
+        for (size_t value : values) {
+            const auto& value_spans = spans[value];
+            const Span& first = value_spans.front();
+            if (!IsPure(code, first) || !IsIn(states, first, {kKept, kStored})) {
+                continue;
+            }
+
+            /* Each later span saves its cost, less the cost of a load or of a `dup` */
+            std::vector<Span> reused;
+            int saved_by_slot = -costs_.GetCost(Opcode::kDup) - GetSlotCost(Opcode::kPop);
+            for (size_t i = 1; i < value_spans.size(); ++i) {
+                const Span& span = value_spans[i];
+                int saved = GetCost(code, span) - GetSlotCost(Opcode::kPush);
+                if (saved > 0 && IsPure(code, span) && IsIn(states, span, {kKept})) {
+                    reused.push_back(span);
+                    saved_by_slot += saved;
+                }
+            }
+            if (reused.empty()) {
+                continue;
+            }
+            int saved_by_dup = 0;
+            if (reused.size() == 1 && reused[0].begin == first.end) {
+                saved_by_dup = GetCost(code, reused[0]) - costs_.GetCost(Opcode::kDup);
+            }
+            if (saved_by_dup <= 0 && saved_by_slot <= 0) {
+                continue;
+            }
+
+            Instruction load(Opcode::kDup, Operand());
+            if (saved_by_dup >= saved_by_slot) {
+                ++dup_count_;
+            } else {
+                load = Instruction(Opcode::kPush, Operand::Local(next_slot));
+                stores[first.end - 1] = next_slot++;
+                states[first.end - 1] = kStored;
+                ++slot_count_;
+            }
+            for (const auto& span : reused) {
+                std::fill(states.begin() + span.begin, states.begin() + span.end, kReplaced);
+                replacements.emplace(span.begin, Replacement{span.end, load});
+            }
+        }
+        if (replacements.empty()) {
+            return;
+        }
+
+        std::vector<Instruction> numbered;
+        numbered.reserve(code.size() + 2 * stores.size());
+        for (size_t i = 0; i < code.size(); ++i) {
+            auto replacement = replacements.find(i);
+            if (replacement != replacements.end()) {
+                numbered.push_back(replacement->second.load);
+                i = replacement->second.end - 1;
+                continue;
+            }
+            numbered.push_back(code[i]);
+            auto store = stores.find(i);
+            if (store != stores.end()) {
+                numbered.emplace_back(Opcode::kDup, Operand());
+                numbered.emplace_back(Opcode::kPop, Operand::Local(store->second));
+            }
+        }
+        code.swap(numbered);
+    }
+
+    void PrintStats(std::ostream& out) const {
+        out << std::left << std::setw(44) << "value numbering" << std::right << std::setw(12) << "reuses"
+            << '\n';
+        out << std::left << std::setw(44) << "kept by dup" << std::right << std::setw(12) << dup_count_
+            << '\n';
+        out << std::left << std::setw(44) << "kept in a slot" << std::right << std::setw(12) << slot_count_
+            << '\n';
+    }
+
+private:
+    /* Instructions [begin, end) computing a word */
+    struct Span {
+        size_t begin;
+        size_t end;
+    };
+
+    /* A reused span, up to `end`, is replaced by `load` */
+    struct Replacement {
+        size_t end;
+        Instruction load;
+    };
+
+    /* A word of the operand stack: its value number and where its span begins */
+    struct Word {
+        size_t value;
+        size_t begin;
+    };
+
+    enum State : uint8_t {
+        kKept,
+        kStored,    /* ends the first span of a value stored into a slot */
+        kReplaced,  /* in a span replaced by the stored value */
+    };
+
+    static constexpr size_t kNoSpan = std::numeric_limits<size_t>::max();
+
+    using Key = std::tuple<Opcode, Operand::Kind, int64_t, size_t, size_t>;
+
+    /* The spans of every value number, in order */
+    static std::vector<std::vector<Span>> GetSpans(const std::vector<Instruction>& code) {
+        std::vector<std::vector<Span>> spans;
+        std::map<Key, size_t> value_of_key;
+        std::map<int64_t, size_t> version_of_local;
+        std::vector<Word> stack;
+        auto get_value = [&spans, &value_of_key](const Key& key) {
+            auto iter = value_of_key.try_emplace(key, spans.size()).first;
+            if (iter->second == spans.size()) {
+                spans.emplace_back();
+            }
+            return iter->second;
+        };
+        auto get_unique = [&spans]() {
+            spans.emplace_back();
+            return spans.size() - 1;
+        };
+
+        for (size_t i = 0; i < code.size(); ++i) {
+            const Instruction& instruction = code[i];
+            Opcode op = instruction.op;
+            if (op == Opcode::kLabel) {
+                value_of_key.clear();
+                for (auto& word : stack) {
+                    word = {get_unique(), kNoSpan};
+                }
+                continue;
+            }
+
+            size_t operand_count = GetOperandCount(op);
+            if (stack.size() < operand_count) {
+                stack.clear();
+                continue;
+            }
+            if (op == Opcode::kPush) {
+                size_t version = 0;
+                if (instruction.kind == Operand::kLocal) {
+                    version = version_of_local[instruction.value];
+                }
+                bool is_pure = IsPureOperand(instruction.kind);
+                size_t value = is_pure ? get_value({op, instruction.kind, instruction.value, version, 0})
+                                       : get_unique();
+                stack.push_back({value, i});
+            } else if (op == Opcode::kPop) {
+                if (instruction.kind == Operand::kLocal) {
+                    version_of_local[instruction.value] = get_unique();
+                }
+                stack.pop_back();
+                continue;
+            } else if (op == Opcode::kDup) {
+                stack.push_back({stack.back().value, i});
+            } else if (IsOperator(op)) {
+                Word word = stack.back();
+                size_t rhs = 0;
+                if (operand_count == 2) {
+                    rhs = word.value;
+                    stack.pop_back();
+                    word = stack.back();
+                    if (IsCommutative(op) && rhs < word.value) {
+                        std::swap(rhs, word.value);
+                    }
+                }
+                stack.back() = {get_value({op, Operand::kNone, 0, word.value, rhs}), word.begin};
+            } else {
+                continue;
+            }
+
+            if (stack.back().begin != kNoSpan) {
+                spans[stack.back().value].push_back({stack.back().begin, i + 1});
+            }
+        }
+        return spans;
+    }
+
+    /* Constants, addresses and locals, which only a `pop` to the local changes */
+    static bool IsPureOperand(Operand::Kind kind) {
+        return kind == Operand::kImmediate || kind == Operand::kSymbol || kind == Operand::kLocal;
+    }
+
+    static bool IsOperator(Opcode op) {
+        return Opcode::kAdd <= op && op <= Opcode::kCge;
+    }
+
+    /* Words an instruction takes from the stack */
+    static size_t GetOperandCount(Opcode op) {
+        switch (op) {
+            case Opcode::kPop:
+            case Opcode::kDup:
+            case Opcode::kNeg:
+            case Opcode::kNot:
+            case Opcode::kBool:
+                return 1;
+            default:
+                return IsOperator(op) ? 2 : 0;
+        }
+    }
+
+    /* The span is only pushes of constants and locals, `dup` and operators, and pushes one word */
+    static bool IsPure(const std::vector<Instruction>& code, const Span& span) {
+        int depth = 0;
+        for (size_t i = span.begin; i < span.end; ++i) {
+            const Instruction& instruction = code[i];
+            if (instruction.op == Opcode::kPush) {
+                if (!IsPureOperand(instruction.kind)) {
+                    return false;
+                }
+                ++depth;
+            } else if (instruction.op == Opcode::kDup) {
+                ++depth;
+            } else if (IsOperator(instruction.op)) {
+                depth -= static_cast<int>(GetOperandCount(instruction.op)) - 1;
+                if (depth < 1) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+        }
+        return depth == 1;
+    }
+
+    static bool IsIn(const std::vector<State>& states, const Span& span,
+                     std::initializer_list<State> allowed) {
+        return std::all_of(states.begin() + span.begin, states.begin() + span.end, [allowed](State state) {
+            return std::find(allowed.begin(), allowed.end(), state) != allowed.end();
+        });
+    }
+
+    /* `push|pop slot`, lowered to `push offset; push %frame; add; pop %scratch; push|pop !scratch` */
+    int GetSlotCost(Opcode op) const {
+        return 2 * costs_.GetCost(Opcode::kPush) + costs_.GetCost(Opcode::kAdd) +
+               costs_.GetCost(Opcode::kPop) + costs_.GetCost(op);
+    }
+
+    int GetCost(const std::vector<Instruction>& code, const Span& span) const {
+        int cost = 0;
+        for (size_t i = span.begin; i < span.end; ++i) {
+            cost += costs_.GetCost(code[i].op);
+        }
+        return cost;
+    }
+
+    const CostTable& costs_;
+    int dup_count_ = 0;
+    int slot_count_ = 0;
+};
+
+}  /* namespace vpl */
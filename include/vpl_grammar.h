@@ -1,16 +1,25 @@
 #pragma once
 
 #include "grammar_pre.h"
+#include <charconv>
 #include <iomanip>
+#include <limits>
 #include <memory>
+#include <sstream>
 
+#include "vpl/fold.h"
 #include "vpl/scope.h"
 
-#define GET_TOKEN_STRING(node) dynamic_cast<const ASTTokenBasic*>(( node ).get())->GetStr()
+#define GET_TOKEN_STRING(node) dynamic_cast<const ASTTokenBasic*>( node )->GetStr()
+#define GET_TOKEN_SYMBOL(node) dynamic_cast<const ASTTokenBasic*>( node )->GetSymbol()
 
 DEFGRAMMAR(VPL)
     DEFBASICNODE()
     public:
+        using Opcode = vpl::Opcode;
+        using Operand = vpl::Operand;
+        using LabelKind = vpl::LabelKind;
+
         virtual void Print(std::ostream& out) {
             out << '[' << std::quoted(GetName()) << ", ";
             bool is_first = true;
@@ -24,18 +33,469 @@ DEFGRAMMAR(VPL)
             }
             out << ']';
         }
-        virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const {
+        virtual void Resolve(vpl::Resolver* resolver) {
+            for (const auto& child : children_) {
+                child->Resolve(resolver);
+            }
+            Fold();
+        }
+        virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const {
             for (const auto& child : children_) {
                 child->BuildProgram(scope, out);
             }
         }
+        /* Builds an expression whose value is unused, leaving nothing on the stack */
+        virtual void BuildDiscarded(vpl::Scope* scope, vpl::Module* out) const {
+            if (is_constant_) {
+                return;
+            }
+            BuildProgram(scope, out);
+            out->Emit(Opcode::kPop, Operand::Immediate(0));
+            scope->Pop();
+        }
+        /*
+         * Builds a condition that jumps to `target` if its truth is `jump_if` and falls through
+         * otherwise. `jz` and `jnz` do not pop, so both paths leave a word on the stack. If
+         * `is_value_kept`, the truth of that word is the condition's, which `&&` and `||` need to
+         * give their value.
+         */
+        virtual void BuildBranch(vpl::Scope* scope, vpl::Module* out, bool jump_if, const Operand& target,
+                                 bool /* is_value_kept */) const {
+            BuildProgram(scope, out);
+            if (is_constant_) {
+                if ((constant_ != 0) == jump_if) {
+                    out->Emit(Opcode::kJmp, target);
+                }
+                return;
+            }
+            out->Emit(jump_if ? Opcode::kJnz : Opcode::kJz, target);
+        }
+        /* An expression that has no side effects and reads nothing a call could change */
+        virtual bool IsPure() const {
+            for (const auto& child : children_) {
+                if (!child->IsPure()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        /* The function a call expression calls, -1 for other nodes */
+        virtual int GetCalledFunction() const {
+            return -1;
+        }
+        bool CallsFunction(int function) const {
+            if (GetCalledFunction() == function) {
+                return true;
+            }
+            for (const auto& child : children_) {
+                if (child->CallsFunction(function)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /* An expression that stores into a variable */
+        virtual bool AssignsVariable() const {
+            for (const auto& child : children_) {
+                if (child->AssignsVariable()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        /* Operand stack words the evaluation of an expression takes at most, its result included */
+        int GetStackNeed() const {
+            if (stack_need_ == 0) {
+                stack_need_ = is_constant_ ? 1 : ComputeStackNeed();
+            }
+            return stack_need_;
+        }
+
+        /* A constant expression has a value known at compile time and no side effects */
+        bool IsConstant() const {
+            return is_constant_;
+        }
+        int64_t GetConstant() const {
+            return constant_;
+        }
+        /* Finds the value of a constant expression once its children are resolved */
+        virtual void Fold() {
+            Terms terms = GetTerms();
+            if (terms.empty()) {
+                return;
+            }
+            int64_t value = terms[0].node->GetConstant();
+            bool is_constant = terms[0].node->IsConstant();
+            for (size_t i = 1; i < terms.size() && is_constant; ++i) {
+                is_constant = terms[i].node->IsConstant() &&
+                              vpl::Evaluate(terms[i].op, value, terms[i].node->GetConstant(), &value);
+            }
+            if (is_constant) {
+                SetConstant(value);
+                return;
+            }
+
+            /* `x * 0` is 0 if x may be left out */
+            int64_t annihilator = 0;
+            if (!IsSameOperator(terms) || !vpl::GetAnnihilator(terms[0].op, &annihilator)) {
+                return;
+            }
+            vpl::GetIdentity(terms[0].op, &value);
+            for (const auto& term : terms) {
+                if (term.node->IsConstant()) {
+                    vpl::Evaluate(term.op, value, term.node->GetConstant(), &value);
+                } else if (!term.node->IsPure()) {
+                    return;
+                }
+            }
+            if (value == annihilator) {
+                SetConstant(value);
+            }
+        }
+
+    protected:
+        /* An operand of a binary rule and the operator applied to it, the first one has the second's */
+        struct Term {
+            NodePtr node;
+            Opcode op;
+        };
+        using Terms = std::vector<Term>;
+
+        /* Operands of a binary rule in order, empty for the other nodes */
+        virtual Terms GetTerms() const {
+            return {};
+        }
+        /* Terms of a rule without operator tokens */
+        Terms GetChainTerms(Opcode op) const {
+            Terms terms;
+            for (const auto& child : children_) {
+                terms.push_back({child, op});
+            }
+            return terms;
+        }
+        /* Terms of a rule that keeps its operator tokens between the operands */
+        Terms GetTokenTerms(Opcode (*get_opcode)(int)) const {
+            Terms terms;
+            for (size_t i = 0; i < children_.size(); i += 2) {
+                size_t token = i != 0 ? i - 1 : 1;
+                terms.push_back({children_[i], token < children_.size()
+                                                   ? get_opcode(children_[token]->GetType())
+                                                   : Opcode::kAdd});
+            }
+            return terms;
+        }
+        /* A chain of one commutative operator, which may be evaluated in any order */
+        static bool IsSameOperator(const Terms& terms) {
+            for (const auto& term : terms) {
+                if (term.op != terms[0].op) {
+                    return false;
+                }
+            }
+            return vpl::IsCommutative(terms[0].op);
+        }
+
+        void SetConstant(int64_t value) {
+            is_constant_ = true;
+            constant_ = value;
+        }
+        static void PushConstant(vpl::Scope* scope, vpl::Module* out, int64_t value) {
+            out->Emit(Opcode::kPush, Operand::Immediate(value));
+            scope->Push();
+        }
+        /* Pushes the value of a constant expression, false for the others */
+        bool BuildConstant(vpl::Scope* scope, vpl::Module* out) const {
+            if (is_constant_) {
+                PushConstant(scope, out, constant_);
+            }
+            return is_constant_;
+        }
+
+        virtual int ComputeStackNeed() const {
+            Terms terms = GetTerms();
+            if (!terms.empty()) {
+                return GetTermsNeed(terms);
+            }
+            int need = 1;
+            for (const auto& child : children_) {
+                need = std::max(need, child->GetStackNeed());
+            }
+            return need;
+        }
+
+        static bool IsNegated(const Terms& terms, size_t i) {
+            return i != 0 && terms[i].op == Opcode::kSub;
+        }
+        /* Chains of `+` and `-` and of one commutative operator, and the operator they apply */
+        static bool IsReassociated(const Terms& terms, Opcode* op) {
+            bool is_additive = true;
+            for (const auto& term : terms) {
+                is_additive = is_additive && (term.op == Opcode::kAdd || term.op == Opcode::kSub);
+            }
+            *op = is_additive ? Opcode::kAdd : terms[0].op;
+            return is_additive || IsSameOperator(terms);
+        }
+        /* Two operands may be evaluated in either order if one is pure and the other assigns nothing */
+        static bool CanReorder(NodePtr lhs, NodePtr rhs) {
+            return (lhs->IsPure() && !rhs->AssignsVariable()) || (rhs->IsPure() && !lhs->AssignsVariable());
+        }
+        /* `a op b` evaluated as `b mirror a`, when b takes more stack */
+        static bool IsMirrored(const Terms& terms, Opcode* mirror) {
+            return terms.size() == 2 && vpl::GetMirror(terms[1].op, mirror) &&
+                   terms[1].node->GetStackNeed() > terms[0].node->GetStackNeed() &&
+                   CanReorder(terms[0].node, terms[1].node);
+        }
+
+        /* The constants of a reassociated chain combined, false if there are none but the identity */
+        static bool GetReassociatedConstant(const Terms& terms, Opcode op, int64_t* constant) {
+            int64_t identity = 0;
+            vpl::GetIdentity(op, &identity);
+            *constant = identity;
+            for (size_t i = 0; i < terms.size(); ++i) {
+                if (terms[i].node->IsConstant()) {
+                    vpl::Evaluate(IsNegated(terms, i) ? Opcode::kSub : op, *constant,
+                                  terms[i].node->GetConstant(), constant);
+                }
+            }
+            return *constant != identity;
+        }
+
+        /*
+         * The operands of a reassociated chain that are not constant, in the order they are evaluated.
+         * Every one after the first is evaluated on top of a word, so the one that takes the most stack
+         * goes first (Sethi-Ullman order), if it is not subtracted and may be moved past the others.
+         */
+        static std::vector<size_t> GetReassociatedOrder(const Terms& terms) {
+            std::vector<size_t> order;
+            for (size_t i = 0; i < terms.size(); ++i) {
+                if (!terms[i].node->IsConstant()) {
+                    order.push_back(i);
+                }
+            }
+            size_t first = 0;
+            for (size_t k = 1; k < order.size(); ++k) {
+                NodePtr node = terms[order[k]].node;
+                if (IsNegated(terms, order[k]) ||
+                    node->GetStackNeed() <= terms[order[first]].node->GetStackNeed()) {
+                    continue;
+                }
+                bool is_movable = true;
+                for (size_t j = 0; j < k && is_movable; ++j) {
+                    is_movable = CanReorder(terms[order[j]].node, node);
+                }
+                if (is_movable) {
+                    first = k;
+                }
+            }
+            if (!order.empty()) {
+                std::rotate(order.begin(), order.begin() + first, order.begin() + first + 1);
+            }
+            return order;
+        }
+
+        /* Stack words a binary rule takes as BuildTerms evaluates it */
+        static int GetTermsNeed(const Terms& terms) {
+            Opcode op;
+            if (IsReassociated(terms, &op)) {
+                int64_t constant = 0;
+                bool has_constant = GetReassociatedConstant(terms, op, &constant);
+                std::vector<size_t> order = GetReassociatedOrder(terms);
+                int below = has_constant && !order.empty() && IsNegated(terms, order[0]) ? 1 : 0;
+                int need = 1 + below;
+                for (size_t k = 0; k < order.size(); ++k) {
+                    need = std::max(need, terms[order[k]].node->GetStackNeed() + (k != 0 ? 1 : below));
+                }
+                return std::max(need, has_constant ? 2 : 1);
+            }
+            Opcode mirror;
+            if (IsMirrored(terms, &mirror)) {
+                return std::max(terms[1].node->GetStackNeed(), terms[0].node->GetStackNeed() + 1);
+            }
+            int need = terms[0].node->GetStackNeed();
+            for (size_t i = 1; i < terms.size(); ++i) {
+                need = std::max(need, terms[i].node->GetStackNeed() + 1);
+            }
+            return need;
+        }
+
+        /*
+         * Builds a binary rule. Chains of `+` and `-` or of one commutative operator gather their
+         * constants into one operand, other chains fold a constant prefix. Identities are left out.
+         */
+        void BuildTerms(vpl::Scope* scope, vpl::Module* out) const {
+            if (BuildConstant(scope, out)) {
+                return;
+            }
+            Terms terms = GetTerms();
+            Opcode op;
+            if (IsReassociated(terms, &op)) {
+                BuildReassociated(terms, op, scope, out);
+                return;
+            }
+            if (IsMirrored(terms, &op)) {
+                terms[1].node->BuildProgram(scope, out);
+                terms[0].node->BuildProgram(scope, out);
+                out->Emit(op);
+                scope->Pop();
+                return;
+            }
+
+            size_t i = 1;
+            if (terms[0].node->IsConstant()) {
+                int64_t value = terms[0].node->GetConstant();
+                while (i < terms.size() && terms[i].node->IsConstant() &&
+                       vpl::Evaluate(terms[i].op, value, terms[i].node->GetConstant(), &value)) {
+                    ++i;
+                }
+                PushConstant(scope, out, value);
+            } else {
+                terms[0].node->BuildProgram(scope, out);
+            }
+            for (; i < terms.size(); ++i) {
+                int64_t identity = 0;
+                if (terms[i].node->IsConstant() && vpl::GetIdentity(terms[i].op, &identity) &&
+                    terms[i].node->GetConstant() == identity) {
+                    continue;
+                }
+                terms[i].node->BuildProgram(scope, out);
+                out->Emit(terms[i].op);
+                scope->Pop();
+            }
+        }
+
+        /* The operands that are not constant, and the constants combined into one */
+        static void BuildReassociated(const Terms& terms, Opcode op, vpl::Scope* scope, vpl::Module* out) {
+            int64_t constant = 0;
+            bool has_constant = GetReassociatedConstant(terms, op, &constant);
+            std::vector<size_t> order = GetReassociatedOrder(terms);
+
+            /* `c - x` rather than `-x + c`, and only the constant if all operands are */
+            bool is_constant_first = order.empty() || (has_constant && IsNegated(terms, order[0]));
+            if (is_constant_first) {
+                PushConstant(scope, out, constant);
+            }
+            for (size_t k = 0; k < order.size(); ++k) {
+                bool is_negated = IsNegated(terms, order[k]);
+                terms[order[k]].node->BuildProgram(scope, out);
+                if (k == 0 && !is_constant_first) {
+                    if (is_negated) {
+                        out->Emit(Opcode::kNeg);
+                    }
+                    continue;
+                }
+                out->Emit(is_negated ? Opcode::kSub : op);
+                scope->Pop();
+            }
+            if (is_constant_first || !has_constant) {
+                return;
+            }
+
+            if (op == Opcode::kMul && constant == -1) {
+                out->Emit(Opcode::kNeg);
+                return;
+            }
+            if (op == Opcode::kAdd && constant < 0 && constant != std::numeric_limits<int64_t>::min()) {
+                PushConstant(scope, out, -constant);
+                out->Emit(Opcode::kSub);
+            } else {
+                PushConstant(scope, out, constant);
+                out->Emit(op);
+            }
+            scope->Pop();
+        }
+
+        /* Folds `&&` and `||`, the operands after the first equal to `decisive` are not evaluated */
+        void FoldShortCircuit(bool decisive) {
+            for (const auto& child : children_) {
+                if (!child->IsConstant()) {
+                    return;
+                }
+                if ((child->GetConstant() != 0) == decisive) {
+                    SetConstant(decisive);
+                    return;
+                }
+            }
+            SetConstant(!decisive);
+        }
+
+        /* Operands of `&&` or `||` up to the first constant that decides it, other constants left out */
+        std::vector<NodePtr> GetShortCircuitOperands(bool decisive) const {
+            std::vector<NodePtr> operands;
+            for (const auto& child : children_) {
+                bool is_constant = child->IsConstant();
+                if (!is_constant || (child->GetConstant() != 0) == decisive) {
+                    operands.push_back(child);
+                }
+                if (is_constant && (child->GetConstant() != 0) == decisive) {
+                    break;
+                }
+            }
+            return operands;
+        }
+
+        /*
+         * The value of `&&` or `||`: every operand but the last jumps to the end once it decides the
+         * result, and `bool` there turns the word left on the stack into it.
+         */
+        void BuildShortCircuit(vpl::Scope* scope, vpl::Module* out, bool decisive) const {
+            if (BuildConstant(scope, out)) {
+                return;
+            }
+            if (children_.size() == 1) {
+                children_[0]->BuildProgram(scope, out);
+                return;
+            }
+            std::vector<NodePtr> operands = GetShortCircuitOperands(decisive);
+            int unique_id = operands.size() > 1 ? scope->GetUnique() : 0;
+            Operand end = Operand::Label(unique_id, LabelKind::kEnd);
+            for (size_t i = 0; i + 1 < operands.size(); ++i) {
+                operands[i]->BuildBranch(scope, out, decisive, end, true);
+                out->Emit(Opcode::kPop, Operand::Immediate(0));
+                scope->Pop();
+            }
+            operands.back()->BuildProgram(scope, out);
+            if (operands.size() > 1) {
+                out->Label(unique_id, LabelKind::kEnd);
+            }
+            out->Emit(Opcode::kBool);
+        }
+
+        /*
+         * `&&` and `||` as a condition: a jump sequence. An operand that decides the result the way
+         * the branch is taken jumps to the target, one that decides it the other way skips the rest.
+         */
+        void BuildShortCircuitBranch(vpl::Scope* scope, vpl::Module* out, bool decisive, bool jump_if,
+                                     const Operand& target, bool is_value_kept) const {
+            if (is_constant_ || children_.size() == 1) {
+                ASTNodeBasic::BuildBranch(scope, out, jump_if, target, is_value_kept);
+                return;
+            }
+            std::vector<NodePtr> operands = GetShortCircuitOperands(decisive);
+            bool is_skipped = jump_if != decisive && operands.size() > 1;
+            int unique_id = is_skipped ? scope->GetUnique() : 0;
+            Operand skip = Operand::Label(unique_id, LabelKind::kEnd);
+            for (size_t i = 0; i + 1 < operands.size(); ++i) {
+                operands[i]->BuildBranch(scope, out, decisive, is_skipped ? skip : target, is_value_kept);
+                out->Emit(Opcode::kPop, Operand::Immediate(0));
+                scope->Pop();
+            }
+            operands.back()->BuildBranch(scope, out, jump_if, target, is_value_kept);
+            if (is_skipped) {
+                out->Label(unique_id, LabelKind::kEnd);
+            }
+        }
+
+    private:
+        bool is_constant_ = false;
+        int64_t constant_ = 0;
+        mutable int stack_need_ = 0;
     ENDBASICNODE()
 
     MAINRULE(MainRule)
 
     DEFRULES()
         DEFRULE(MainRule)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 for (size_t i = 0; i < children_.size(); ++i) {
                     children_[i]->BuildProgram(scope, out);
                 }
@@ -50,26 +510,31 @@ DEFGRAMMAR(VPL)
         ENDRULE(MainRule)
 
         DEFRULE(FunctionDefinition)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                out << "func " << scope->GetLastFunctionName() << '\n';
-                scope->SpawnFunctionScope();
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                children_[0]->Resolve(resolver);
+                function_ = resolver->BeginFunction();
+                children_[1]->Resolve(resolver);
+                resolver->EndFunction();
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                scope->BeginFunction(function_);
                 children_[1]->BuildProgram(scope, out);
-                scope->CloseScope();
-                out << "    ret\n";
+                out->Emit(Opcode::kRet);
             }
+        private:
+            int function_ = -1;
         BEGINRULE(FunctionDefinition)
             EXPECT(decl, RULE(FunctionDeclaration));
             EXPECT(body, RULE(CompoundStatement));
         ENDRULE(FunctionDefinition)
 
         DEFRULE(CompoundStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->OpenScope();
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                resolver->OpenScope();
                 for (const auto& child : children_) {
-                    child->BuildProgram(scope, out);
+                    child->Resolve(resolver);
                 }
-                scope->CloseScope();
+                resolver->CloseScope();
             }
         BEGINRULE(CompoundStatement)
             TOKEN(LeftBrace);
@@ -87,13 +552,14 @@ DEFGRAMMAR(VPL)
                 EXPECT(stmt, RULE(JumpStatement)),
                 EXPECT(stmt, RULE(DeclarationStatement));
             );
+            UNWRAP();
         ENDRULE(Statement)
 
         DEFRULE(ExpressionStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 if (!children_.empty()) {
                     scope->SaveStackPos();
-                    children_[0]->BuildProgram(scope, out);
+                    children_[0]->BuildDiscarded(scope, out);
                     scope->RestoreStackPos();
                 }
             }
@@ -103,25 +569,36 @@ DEFGRAMMAR(VPL)
         ENDRULE(ExpressionStatement)
 
         DEFRULE(IfStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                /* Only the branch a constant condition takes is built */
+                if (children_[0]->IsConstant()) {
+                    if (children_[0]->GetConstant() != 0) {
+                        children_[1]->BuildProgram(scope, out);
+                    } else if (children_.size() == 3) {
+                        children_[2]->BuildProgram(scope, out);
+                    }
+                    return;
+                }
+
                 int unique_id = scope->GetUnique();
 
-                out << "func .L" << unique_id << "_if\n";
-                children_[0]->BuildProgram(scope, out);
-                out << "    jz .L" << unique_id << "_else\n";
+                out->Label(unique_id, LabelKind::kIf);
+                Operand else_label = Operand::Label(unique_id, LabelKind::kElse);
+                children_[0]->BuildBranch(scope, out, false, else_label, false);
 
-                out << "func .L" << unique_id << "_then\n";
-                out << "    pop 0\n";
+                out->Label(unique_id, LabelKind::kThen);
+                out->Emit(Opcode::kPop, Operand::Immediate(0));
+                scope->Pop();
                 children_[1]->BuildProgram(scope, out);
-                out << "    jmp .L" << unique_id << "_end\n";
+                out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kEnd));
 
-                out << "func .L" << unique_id << "_else\n";
-                out << "    pop 0\n";
+                out->Label(unique_id, LabelKind::kElse);
+                out->Emit(Opcode::kPop, Operand::Immediate(0));
                 if (children_.size() == 3) {
                     children_[2]->BuildProgram(scope, out);
                 }
 
-                out << "func .L" << unique_id << "_end\n";
+                out->Label(unique_id, LabelKind::kEnd);
             }
         BEGINRULE(IfStatement)
             TOKEN(IfKeyword);
@@ -142,22 +619,37 @@ DEFGRAMMAR(VPL)
                 EXPECT(do_while_loop, RULE(DoWhileStatment)),
                 EXPECT(for_loop, RULE(ForStatement))
             );
+            UNWRAP();
         ENDRULE(LoopStatement)
 
         DEFRULE(WhileStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            /*
+             * The test is at the bottom of the loop, so that an iteration takes a single branch. A false
+             * constant condition leaves out the loop, a true one its test.
+             */
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 int unique_id = scope->GetUnique();
-
-                out << "func .L" << unique_id << "_while\n";
-                children_[0]->BuildProgram(scope, out);
-                out << "    jz .L" << unique_id << "_end_while\n";
-
-                out << "    pop 0\n";
-                children_[1]->BuildProgram(scope, out);
-                out << "    jmp .L" << unique_id << "_while\n";
-                out << "func .L" << unique_id << "_end_while\n";
-                out << "    pop 0\n";
-                out << "func .L" << unique_id << "_end\n";
+                const auto& cond = children_[0];
+                if (cond->IsConstant() && cond->GetConstant() == 0) {
+                    return;
+                }
+                scope->BeginLoop(unique_id);
+                if (cond->IsConstant()) {
+                    out->Label(unique_id, LabelKind::kWhile);
+                    children_[1]->BuildProgram(scope, out);
+                    out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kWhile));
+                } else {
+                    out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kCond));
+                    out->Label(unique_id, LabelKind::kWhile);
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                    children_[1]->BuildProgram(scope, out);
+                    out->Label(unique_id, LabelKind::kCond);
+                    cond->BuildBranch(scope, out, true, Operand::Label(unique_id, LabelKind::kWhile), false);
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                    scope->Pop();
+                }
+                out->Label(unique_id, LabelKind::kEnd);
+                scope->EndLoop();
             }
         BEGINRULE(WhileStatement)
             TOKEN(WhileKeyword);
@@ -168,16 +660,31 @@ DEFGRAMMAR(VPL)
         ENDRULE(WhileStatment)
 
         DEFRULE(DoWhileStatment)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 int unique_id = scope->GetUnique();
-                out << "    push 0\n";
-                out << "func .L" << unique_id << "_do_while\n";
-                out << "    pop 0\n";
-                children_[0]->BuildProgram(scope, out);
-                children_[1]->BuildProgram(scope, out);
-                out << "    jnz .L" << unique_id << "_do_while\n";
-                out << "    pop 0\n";
-                out << "func .L" << unique_id << "_end\n";
+                scope->BeginLoop(unique_id);
+                /* The body runs once for a false constant condition and forever for a true one */
+                if (children_[1]->IsConstant()) {
+                    bool is_infinite = children_[1]->GetConstant() != 0;
+                    if (is_infinite) {
+                        out->Label(unique_id, LabelKind::kDoWhile);
+                    }
+                    children_[0]->BuildProgram(scope, out);
+                    if (is_infinite) {
+                        out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kDoWhile));
+                    }
+                } else {
+                    out->Emit(Opcode::kPush, Operand::Immediate(0));
+                    out->Label(unique_id, LabelKind::kDoWhile);
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                    children_[0]->BuildProgram(scope, out);
+                    Operand loop = Operand::Label(unique_id, LabelKind::kDoWhile);
+                    children_[1]->BuildBranch(scope, out, true, loop, false);
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                    scope->Pop();
+                }
+                out->Label(unique_id, LabelKind::kEnd);
+                scope->EndLoop();
             }
         BEGINRULE(DoWhileStatment)
             TOKEN(DoKeyword);
@@ -190,19 +697,37 @@ DEFGRAMMAR(VPL)
         ENDRULE(DoWhileStatment)
 
         DEFRULE(ForStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            /* Rotated like `while`. A missing condition is true. */
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 int unique_id = scope->GetUnique();
                 children_[0]->BuildProgram(scope, out);
-                out << "func .L" << unique_id << "_for\n";
-                children_[1]->BuildProgram(scope, out);
-                out << "    jz .L" << unique_id << "_end_for\n";
-                out << "    pop 0\n";
-                children_[3]->BuildProgram(scope, out);
-                children_[2]->BuildProgram(scope, out);
-                out << "    jmp .L" << unique_id << "_for\n";
-                out << "func .L" << unique_id << "_end_for\n";
-                out << "    pop 0\n";
-                out << "func .L" << unique_id << "_end\n";
+                const auto& cond = children_[1]->GetChildren();
+                bool is_tested = !cond.empty() && !cond[0]->IsConstant();
+                if (!is_tested && !cond.empty() && cond[0]->GetConstant() == 0) {
+                    return;
+                }
+                scope->BeginLoop(unique_id);
+                if (is_tested) {
+                    out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kCond));
+                }
+                out->Label(unique_id, LabelKind::kFor);
+                if (is_tested) {
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                }
+                children_.back()->BuildProgram(scope, out);
+                if (children_.size() == 4) {
+                    children_[2]->BuildDiscarded(scope, out);
+                }
+                if (is_tested) {
+                    out->Label(unique_id, LabelKind::kCond);
+                    cond[0]->BuildBranch(scope, out, true, Operand::Label(unique_id, LabelKind::kFor), false);
+                    out->Emit(Opcode::kPop, Operand::Immediate(0));
+                    scope->Pop();
+                } else {
+                    out->Emit(Opcode::kJmp, Operand::Label(unique_id, LabelKind::kFor));
+                }
+                out->Label(unique_id, LabelKind::kEnd);
+                scope->EndLoop();
             }
         BEGINRULE(ForStatement)
             TOKEN(ForKeyword);
@@ -215,19 +740,95 @@ DEFGRAMMAR(VPL)
         ENDRULE(ForStatement)
 
         DEFRULE(JumpStatement)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                if (children_[0]->GetType() == kBreakKeywordType) {
-                    out << "    jmp .L" << scope->GetPreviousUnique() << "_end\n";
+            /*
+             * `return f(...)` in f is a tail call. `return x op f(...)` is an accumulating call if op
+             * is `+` or `*`, x does not call f, and x is evaluated first or is pure, so that it may be
+             * moved before the call. In a chain of one of them, x is all the operands but the call,
+             * which is the first or the last.
+             */
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                ASTNodeBasic::Resolve(resolver);
+                if (children_.size() != 2) {
+                    return;
+                }
+                int function = resolver->GetCurrentFunction();
+                const auto* expr = children_[1];
+                if (expr->GetCalledFunction() == function) {
+                    resolver->AddTailCall();
+                    return;
+                }
+                const auto& operands = expr->GetChildren();
+                if (operands.size() < 3 || operands.size() % 2 == 0) {
+                    return;
+                }
+                int op_type = operands[1]->GetType();
+                if (op_type == kPlusType) {
+                    accumulator_op_ = Opcode::kAdd;
+                } else if (op_type == kMultiplyType) {
+                    accumulator_op_ = Opcode::kMul;
                 } else {
-                    if (children_.size() == 2) {
-                        children_[1]->BuildProgram(scope, out);
+                    return;
+                }
+                for (size_t i = 1; i < operands.size(); i += 2) {
+                    if (operands[i]->GetType() != op_type) {
+                        return;
                     }
-                    if (children_.size() == 2) {
-                        out << "    pop %" << scope->RetRegister() << '\n';
+                }
+
+                size_t last = operands.size() - 1;
+                bool calls_first = false;
+                bool is_rest_pure = true;
+                for (size_t i = 0; i < last; i += 2) {
+                    calls_first = calls_first || operands[i]->CallsFunction(function);
+                    is_rest_pure = is_rest_pure && operands[i + 2]->IsPure();
+                }
+                if (operands[last]->GetCalledFunction() == function && !calls_first) {
+                    self_call_ = static_cast<int>(last);
+                } else if (operands[0]->GetCalledFunction() == function && is_rest_pure) {
+                    self_call_ = 0;
+                } else {
+                    return;
+                }
+                resolver->AddAccumulatingCall(accumulator_op_);
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                if (children_[0]->GetType() == kBreakKeywordType) {
+                    out->Emit(Opcode::kJmp, scope->GetBreakTarget());
+                    return;
+                }
+                if (children_.size() == 1) {
+                    out->Emit(Opcode::kRet);
+                    return;
+                }
+
+                const auto* expr = children_[1];
+                if (expr->GetCalledFunction() == scope->GetCurrentFunction()) {
+                    BuildTailCall(expr, scope, out);
+                } else if (self_call_ != -1 && scope->HasAccumulator(accumulator_op_)) {
+                    const auto& operands = expr->GetChildren();
+                    Terms terms;
+                    for (size_t i = 0; i < operands.size(); i += 2) {
+                        if (static_cast<int>(i) != self_call_) {
+                            terms.push_back({operands[i], accumulator_op_});
+                        }
                     }
-                    out << "    ret\n";
+                    BuildReassociated(terms, accumulator_op_, scope, out);
+                    scope->Accumulate();
+                    BuildTailCall(operands[self_call_], scope, out);
+                } else {
+                    expr->BuildProgram(scope, out);
+                    scope->Return();
                 }
             }
+        private:
+            /* The arguments of a call, without the call */
+            static void BuildTailCall(const ASTNodeBasic* call, vpl::Scope* scope, vpl::Module* out) {
+                call->GetChildren()[1]->BuildProgram(scope, out);
+                scope->TailCall();
+            }
+
+            int self_call_ = -1;
+            Opcode accumulator_op_ = Opcode::kAdd;
         BEGINRULE(JumpStatement)
             OR(
 //                EXPECT(continue_stmt, TOKEN(ContinueKeyword)),
@@ -269,8 +870,8 @@ DEFGRAMMAR(VPL)
         ENDRULE(ExternStaticSpecifier)
 */
         DEFRULE(VariableDeclaration)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->CreateVariable(GET_TOKEN_STRING(children_[0]));
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                resolver->CreateVariable(GET_TOKEN_SYMBOL(children_[0]));
             }
         BEGINRULE(VariableDeclaration)
  //           EXPECT(spec, RULE(ExternStaticSpecifier));
@@ -308,13 +909,15 @@ DEFGRAMMAR(VPL)
         ENDRULE(StructDeclaration)
 */
         DEFRULE(FunctionDeclaration)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->DeclareFunction(GET_TOKEN_STRING(children_[1]));
-                children_[2]->BuildProgram(scope, out);
-                scope->EndFunctionDeclaration();
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                bool is_inline = children_[0]->GetType() == kInlineKeywordType;
+                resolver->DeclareFunction(GET_TOKEN_SYMBOL(children_[is_inline + 1]), is_inline);
+                children_[is_inline + 2]->Resolve(resolver);
+                resolver->EndFunctionDeclaration();
             }
         BEGINRULE(FunctionDeclaration)
 //            EXPECT(spec, RULE(ExternStaticSpecifier));
+            MAYBE(EXPECT(inline_spec, TOKEN(InlineKeyword)));
             EXPECT(type, RULE(TypeName));
             EXPECT(name, TOKEN(Identifier));
 
@@ -335,8 +938,8 @@ DEFGRAMMAR(VPL)
         ENDRULE(DeclarationArgumentList)
 
         DEFRULE(DeclarationArgument)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->AddArgumentName(GET_TOKEN_STRING(children_[1]));
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                resolver->AddArgument(GET_TOKEN_SYMBOL(children_[1]));
             }
         BEGINRULE(DeclarationArgument)
             EXPECT(type, RULE(TypeName));
@@ -396,12 +999,15 @@ DEFGRAMMAR(VPL)
         ENDRULE(FunctionPointerTypedef)
 */
         DEFRULE(Expression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    scope->SaveStackPos();
-                    scope->RestoreStackPos();
-                    children_[i]->BuildProgram(scope, out);
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                for (size_t i = 0; i + 1 < children_.size(); ++i) {
+                    children_[i]->BuildDiscarded(scope, out);
+                }
+                children_.back()->BuildProgram(scope, out);
+            }
+            virtual void BuildDiscarded(vpl::Scope* scope, vpl::Module* out) const override {
+                for (const auto& child : children_) {
+                    child->BuildDiscarded(scope, out);
                 }
             }
         BEGINRULE(Expression)
@@ -410,27 +1016,56 @@ DEFGRAMMAR(VPL)
                 TOKEN(Comma);
                 EXPECT(assignment_expr, RULE(AssignmentExpression));
             });
+            UNWRAP();
         ENDRULE(Expression)
 
         DEFRULE(AssignmentExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                if (children_.size() == 1) {
+                    children_[0]->Resolve(resolver);
+                    return;
+                }
+                children_[1]->Resolve(resolver);
+                slot_ = resolver->FindVariable(GET_TOKEN_SYMBOL(children_[0]));
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 if (children_.size() == 1) {
                     children_[0]->BuildProgram(scope, out);
                     return;
                 }
                 children_[1]->BuildProgram(scope, out);
-                scope->LoadVariableAddr(GET_TOKEN_STRING(children_[0]));
-                out << "    pop %" << scope->AssignRegister() << '\n';
-                scope->Pop();
-                out << "    dup\n";
-                out << "    pop !" << scope->AssignRegister() << '\n';
+                out->Emit(Opcode::kDup);
+                scope->Push();
+                scope->StoreVariable(slot_);
+            }
+            virtual void BuildDiscarded(vpl::Scope* scope, vpl::Module* out) const override {
+                if (children_.size() == 1) {
+                    children_[0]->BuildDiscarded(scope, out);
+                    return;
+                }
+                children_[1]->BuildProgram(scope, out);
+                scope->StoreVariable(slot_);
+            }
+            virtual bool IsPure() const override {
+                return false;
+            }
+            virtual bool AssignsVariable() const override {
+                return true;
             }
+        protected:
+            /* The value is duplicated before the store */
+            virtual int ComputeStackNeed() const override {
+                return std::max(children_[1]->GetStackNeed(), 2);
+            }
+        private:
+            vpl::VariableSlot slot_;
         BEGINRULE(AssignmentExpression)
             MAYBE({
                 EXPECT(name, TOKEN(Identifier));
                 TOKEN(Assign);
             });
             EXPECT(cond_expr, RULE(OrExpression));
+            UNWRAP();
         ENDRULE(AssignmentExpression)
 
         DEFRULE(AssignmentOperator)
@@ -452,10 +1087,98 @@ DEFGRAMMAR(VPL)
         ENDRULE(AssignmentOperator)
 
         DEFRULE(UnaryExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                for (int i = children_.size() - 1; i >= 0; --i) {
-                    children_[i]->BuildProgram(scope, out);
+            virtual void Fold() override {
+                if (!children_.back()->IsConstant()) {
+                    return;
+                }
+                int64_t value = children_.back()->GetConstant();
+                for (Opcode op : GetOperators()) {
+                    value = vpl::Evaluate(op, value);
+                }
+                SetConstant(value);
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                if (BuildConstant(scope, out)) {
+                    return;
+                }
+                children_.back()->BuildProgram(scope, out);
+                EmitOperators(GetOperators(), scope, out);
+            }
+            /* `!` swaps the targets, and `-`, `bool` keep the truth, unless the value is kept */
+            virtual void BuildBranch(vpl::Scope* scope, vpl::Module* out, bool jump_if, const Operand& target,
+                                     bool is_value_kept) const override {
+                std::vector<Opcode> ops = GetOperators();
+                if (IsConstant() || is_value_kept) {
+                    ASTNodeBasic::BuildBranch(scope, out, jump_if, target, is_value_kept);
+                    return;
+                }
+                while (!ops.empty() && (ops.back() == Opcode::kNot || ops.back() == Opcode::kBool ||
+                                        ops.back() == Opcode::kNeg)) {
+                    jump_if = ops.back() == Opcode::kNot ? !jump_if : jump_if;
+                    ops.pop_back();
                 }
+                if (ops.empty()) {
+                    children_.back()->BuildBranch(scope, out, jump_if, target, false);
+                    return;
+                }
+                children_.back()->BuildProgram(scope, out);
+                EmitOperators(ops, scope, out);
+                out->Emit(jump_if ? Opcode::kJnz : Opcode::kJz, target);
+            }
+        protected:
+            /* `~` pushes its mask on top of the operand */
+            virtual int ComputeStackNeed() const override {
+                std::vector<Opcode> ops = GetOperators();
+                bool has_mask = std::find(ops.begin(), ops.end(), Opcode::kXor) != ops.end();
+                return std::max(children_.back()->GetStackNeed(), has_mask ? 2 : 1);
+            }
+        private:
+            static void EmitOperators(const std::vector<Opcode>& ops, vpl::Scope* scope, vpl::Module* out) {
+                for (Opcode op : ops) {
+                    if (op == Opcode::kXor) {
+                        out->Emit(Opcode::kPush, Operand::Immediate(-1));
+                        scope->Push();
+                        out->Emit(Opcode::kXor);
+                        scope->Pop();
+                    } else {
+                        out->Emit(op);
+                    }
+                }
+            }
+            /*
+             * Operators in the order they apply, `xor` standing for `~`. Pairs of `-` and of `~` cancel
+             * out, `!!` is `bool` and `!` after `bool` is `!` alone.
+             */
+            std::vector<Opcode> GetOperators() const {
+                std::vector<Opcode> ops;
+                for (int i = children_.size() - 2; i >= 0; --i) {
+                    Opcode op;
+                    switch (children_[i]->GetChildren()[0]->GetType()) {
+                        case kMinusType:
+                            op = Opcode::kNeg;
+                            break;
+                        case kNotType:
+                            op = Opcode::kNot;
+                            break;
+                        case kBitwiseNotType:
+                            op = Opcode::kXor;
+                            break;
+                        default:
+                            continue;
+                    }
+                    if (ops.empty()) {
+                        ops.push_back(op);
+                    } else if (op == Opcode::kNot && ops.back() == Opcode::kNot) {
+                        ops.back() = Opcode::kBool;
+                    } else if (op == Opcode::kNot && ops.back() == Opcode::kBool) {
+                        ops.back() = Opcode::kNot;
+                    } else if (op == ops.back()) {
+                        ops.pop_back();
+                    } else {
+                        ops.push_back(op);
+                    }
+                }
+                return ops;
             }
         BEGINRULE(UnaryExpression)
 //            OR5(
@@ -484,6 +1207,7 @@ DEFGRAMMAR(VPL)
                     TOKEN(RightParen);
                 }
             );*/
+            UNWRAP();
         ENDRULE(UnaryExpression)
 
         DEFRULE(CastExpression)
@@ -497,6 +1221,7 @@ DEFGRAMMAR(VPL)
                 },
                 EXPECT(unary_expr, RULE(UnaryExpression))
             );
+            UNWRAP();
         ENDRULE(CastExpression)
 
 
@@ -526,6 +1251,7 @@ DEFGRAMMAR(VPL)
                 EXPECT(call_expr, RULE(CallExpression)),
                 EXPECT(primary_expr, RULE(PrimaryExpression))
             );
+            UNWRAP();
 /*
             ASTERISK(OR5(
                 EXPECT(subscript_op, RULE(SubscriptOp)),
@@ -539,32 +1265,85 @@ DEFGRAMMAR(VPL)
         ENDRULE(PostfixExpression)
 
         DEFRULE(CallExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->PrepareFunction(GET_TOKEN_STRING(children_[0]));
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                function_ = resolver->FindFunction(GET_TOKEN_SYMBOL(children_[0]));
+                resolver->CheckArgCnt(function_, children_[1]->GetChildren().size());
+                children_[1]->Resolve(resolver);
+                frame_size_ = resolver->FrameSize();
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 children_[1]->BuildProgram(scope, out);
-                scope->CallFunction(GET_TOKEN_STRING(children_[0]));
+                scope->CallFunction(function_, frame_size_);
             }
+            virtual bool IsPure() const override {
+                return false;
+            }
+            virtual int GetCalledFunction() const override {
+                return function_;
+            }
+        protected:
+            /* The arguments are evaluated last first, each on top of the ones before */
+            virtual int ComputeStackNeed() const override {
+                const auto& args = children_[1]->GetChildren();
+                int need = 1;
+                for (size_t i = 0; i < args.size(); ++i) {
+                    need = std::max(need, args[i]->GetStackNeed() + static_cast<int>(args.size() - 1 - i));
+                }
+                return need;
+            }
+        private:
+            int function_ = -1;
+            int frame_size_ = 0;
         BEGINRULE(CallExpression)
             EXPECT(func_name, TOKEN(Identifier));
             EXPECT(call_op, RULE(CallOp));
         ENDRULE(CallExpression)
 
         DEFRULE(PrimaryExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
+            virtual void Resolve(vpl::Resolver* resolver) override {
+                switch (children_[0]->GetType()) {
+                    case kConstantType: {
+                        std::string_view str = GET_TOKEN_STRING(children_[0]);
+                        int64_t value = 0;
+                        auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+                        if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+                            std::stringstream ss;
+                            ss << "Constant `" << str << "` is not an integer";
+                            throw std::runtime_error(ss.str());
+                        }
+                        SetConstant(value);
+                        break;
+                    }
+                    case kBoolConstantType:
+                        SetConstant(GET_TOKEN_STRING(children_[0]) == "true");
+                        break;
+                    case kIdentifierType:
+                        slot_ = resolver->FindVariable(GET_TOKEN_SYMBOL(children_[0]));
+                        break;
+                    default:
+                        children_[0]->Resolve(resolver);
+                        break;
+                }
+            }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 switch (children_[0]->GetType()) {
                     case kConstantType:
                     case kBoolConstantType:
-                        out << "    push " << GET_TOKEN_STRING(children_[0]) << '\n';
-                        scope->Push();
+                        BuildConstant(scope, out);
                         break;
                     case kIdentifierType:
-                        scope->LoadVariable(GET_TOKEN_STRING(children_[0]));
+                        scope->LoadVariable(slot_);
                         break;
                     default:
                         children_[0]->BuildProgram(scope, out);
                         break;
                 }
             }
+            virtual bool IsPure() const override {
+                return children_[0]->GetType() == kIdentifierType ? !slot_.is_global : children_[0]->IsPure();
+            }
+        private:
+            vpl::VariableSlot slot_;
         BEGINRULE(PrimaryExpression)
             OR4(
                 EXPECT(constant, TOKEN(Constant)),
@@ -574,6 +1353,7 @@ DEFGRAMMAR(VPL)
                     TOKEN(LeftParen);
                     EXPECT(expr, RULE(Expression));
                     TOKEN(RightParen);
+                    UNWRAP();
                 }
             );
         ENDRULE(PrimaryExpression)
@@ -586,8 +1366,7 @@ DEFGRAMMAR(VPL)
         ENDRULE(SubscriptOp)
 
         DEFRULE(CallOp)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                scope->CheckArgCnt(children_.size());
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
                 for (int i = children_.size() - 1; i >= 0; --i) {
                     children_[i]->BuildProgram(scope, out);
                 }
@@ -617,20 +1396,6 @@ DEFGRAMMAR(VPL)
         ENDRULE(Arrow)
 
         DEFRULE(UnaryOperator)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                switch (children_[0]->GetType()) {
-                    case kMinusType:
-                        out << "    neg\n";
-                        break;
-                    case kNotType:
-                        out << "    not\n";
-                        break;
-                    case kBitwiseNotType:
-                        out << "    push -1\n";
-                        out << "    xor\n";
-                        break;
-                }
-            }
         BEGINRULE(UnaryOperator)
             OR4(
 //                EXPECT(op, TOKEN(Ampersand)),
@@ -655,254 +1420,157 @@ DEFGRAMMAR(VPL)
         ENDRULE(ConditionalExpression)
 */
         DEFRULE(OrExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                if (children_.size() == 1) {
-                    return;
-                }
-                out << "    bool\n";
-                int unique_id = scope->GetUnique();
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    out << "    jnz .L" << unique_id << "_end\n";
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    bool\n";
-                    out << "    or\n";
-                    scope->Pop();
-                }
-                out << "func .L" << unique_id << "_end\n";
+            virtual void Fold() override {
+                FoldShortCircuit(true);
             }
-        BEGINRULE(OrExpression)
-            EXPECT(and_expr, RULE(AndExpression));
-            ASTERISK({
-                TOKEN(Or);
-                EXPECT(and_expr, RULE(AndExpression));
-            });
-        ENDRULE(OrExpression)
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildShortCircuit(scope, out, true);
+            }
+            virtual void BuildBranch(vpl::Scope* scope, vpl::Module* out, bool jump_if, const Operand& target,
+                                     bool is_value_kept) const override {
+                BuildShortCircuitBranch(scope, out, true, jump_if, target, is_value_kept);
+            }
+        BINARYOPERATORS(OrExpression, 1, false, kOrType)
 
         DEFRULE(AndExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                if (children_.size() == 1) {
-                    return;
-                }
-                out << "    bool\n";
-                int unique_id = scope->GetUnique();
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    out << "    jz .L" << unique_id << "_end\n";
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    bool\n";
-                    out << "    and\n";
-                    scope->Pop();
-                }
-                out << "func .L" << unique_id << "_end\n";
+            virtual void Fold() override {
+                FoldShortCircuit(false);
             }
-        BEGINRULE(AndExpression)
-            EXPECT(bitwise_or_expr, RULE(BitwiseOrExpression));
-            ASTERISK({
-                TOKEN(And);
-                EXPECT(bitwise_or_expr, RULE(BitwiseOrExpression));
-            });
-        ENDRULE(AndExpression)
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildShortCircuit(scope, out, false);
+            }
+            virtual void BuildBranch(vpl::Scope* scope, vpl::Module* out, bool jump_if, const Operand& target,
+                                     bool is_value_kept) const override {
+                BuildShortCircuitBranch(scope, out, false, jump_if, target, is_value_kept);
+            }
+        BINARYOPERATORS(AndExpression, 2, false, kAndType)
 
         DEFRULE(BitwiseOrExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    or\n";
-                    scope->Pop();
-                }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
             }
-        BEGINRULE(BitwiseOrExpression)
-            EXPECT(bitwise_xor_expr, RULE(BitwiseXorExpression));
-            ASTERISK({
-                TOKEN(BitwiseOr);
-                EXPECT(bitwise_xor_expr, RULE(BitwiseXorExpression));
-            });
-        ENDRULE(BitwiseOrExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetChainTerms(Opcode::kOr);
+            }
+        BINARYOPERATORS(BitwiseOrExpression, 3, false, kBitwiseOrType)
 
         DEFRULE(BitwiseXorExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    xor\n";
-                    scope->Pop();
-                }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
             }
-        BEGINRULE(BitwiseXorExpression)
-            EXPECT(bitwise_and_expr, RULE(BitwiseAndExpression));
-            ASTERISK({
-                TOKEN(Xor);
-                EXPECT(bitwise_and_expr, RULE(BitwiseAndExpression));
-            });
-        ENDRULE(BitwiseXorExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetChainTerms(Opcode::kXor);
+            }
+        BINARYOPERATORS(BitwiseXorExpression, 4, false, kXorType)
 
         DEFRULE(BitwiseAndExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 1; i < children_.size(); ++i) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    and\n";
-                    scope->Pop();
-                }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
             }
-        BEGINRULE(BitwiseAndExpression)
-            EXPECT(equality_expr, RULE(EqualityExpression));
-            ASTERISK({
-                TOKEN(BitwiseOr);
-                EXPECT(equality_expr, RULE(EqualityExpression));
-            });
-        ENDRULE(BitwiseAndExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetChainTerms(Opcode::kAnd);
+            }
+        BINARYOPERATORS(BitwiseAndExpression, 5, false, kAmpersandType)
 
         DEFRULE(EqualityExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 2; i < children_.size(); i += 2) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    " << (children_[i - 1]->GetType() == kEqualOpType ? "ceq" : "cne") << "\n";
-                    scope->Pop();
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
+            }
+            /* `x == 0` and `x != 0` test x itself */
+            virtual void BuildBranch(vpl::Scope* scope, vpl::Module* out, bool jump_if, const Operand& target,
+                                     bool is_value_kept) const override {
+                Terms terms = GetTerms();
+                if (IsConstant() || is_value_kept || terms.size() != 2 ||
+                    terms[0].node->IsConstant() == terms[1].node->IsConstant()) {
+                    ASTNodeBasic::BuildBranch(scope, out, jump_if, target, is_value_kept);
+                    return;
+                }
+                NodePtr constant = terms[0].node->IsConstant() ? terms[0].node : terms[1].node;
+                NodePtr operand = terms[0].node->IsConstant() ? terms[1].node : terms[0].node;
+                if (constant->GetConstant() != 0) {
+                    ASTNodeBasic::BuildBranch(scope, out, jump_if, target, is_value_kept);
+                    return;
                 }
+                operand->BuildBranch(scope, out, terms[1].op == Opcode::kCeq ? !jump_if : jump_if, target,
+                                     false);
             }
-        BEGINRULE(EqualityExpression)
-            EXPECT(rel_expr, RULE(RelationalExpression));
-            ASTERISK({
-                OR(
-                    EXPECT(eq_op, TOKEN(EqualOp)),
-                    EXPECT(ne_op, TOKEN(NotEqualOp))
-                );
-                EXPECT(rel_expr, RULE(RelationalExpression));
-            });
-        ENDRULE(EqualityExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetTokenTerms([](int type) {
+                    return type == kEqualOpType ? Opcode::kCeq : Opcode::kCne;
+                });
+            }
+        BINARYOPERATORS(EqualityExpression, 6, true, kEqualOpType, kNotEqualOpType)
 
         DEFRULE(RelationalExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 2; i < children_.size(); i += 2) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    ";
-                    switch(children_[i - 1]->GetType()) {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
+            }
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetTokenTerms([](int type) {
+                    switch (type) {
                         case kLessOrEqualOpType:
-                            out << "    cle\n";
-                            break;
+                            return Opcode::kCle;
                         case kGreaterOrEqualOpType:
-                            out << "    cge\n";
-                            break;
+                            return Opcode::kCge;
                         case kLessOpType:
-                            out << "    clt\n";
-                            break;
-                        case kGreaterOpType:
-                            out << "    cgt\n";
-                            break;
+                            return Opcode::kClt;
+                        default:
+                            return Opcode::kCgt;
                     }
-                    out << '\n';
-                    scope->Pop();
-                }
+                });
             }
-        BEGINRULE(RelationalExpression)
-            EXPECT(shift_expr, RULE(ShiftExpression));
-            ASTERISK({
-                OR4(
-                    EXPECT(op, TOKEN(LessOrEqualOp)),
-                    EXPECT(op, TOKEN(GreaterOrEqualOp)),
-                    EXPECT(op, TOKEN(LessOp)),
-                    EXPECT(op, TOKEN(GreaterOp))
-                );
-                EXPECT(shift_expr, RULE(ShiftExpression));
-            });
-        ENDRULE(RelationalExpression)
+        BINARYOPERATORS(RelationalExpression, 7, true,
+                kLessOrEqualOpType, kGreaterOrEqualOpType, kLessOpType, kGreaterOpType)
 
         DEFRULE(ShiftExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 2; i < children_.size(); i += 2) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    ";
-                    switch(children_[i - 1]->GetType()) {
-                        case kShiftLeftType:
-                            out << "    shl\n";
-                            break;
-                        case kShiftRightType:
-                            out << "    shr\n";
-                            break;
-                    }
-                    out << '\n';
-                    scope->Pop();
-                }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
             }
-        BEGINRULE(ShiftExpression)
-            EXPECT(add_expr, RULE(AdditiveExpression));
-            ASTERISK({
-                OR(
-                    EXPECT(op, TOKEN(ShiftLeft)),
-                    EXPECT(op, TOKEN(ShiftRight))
-                );
-                EXPECT(add_expr, RULE(AdditiveExpression));
-            });
-        ENDRULE(ShiftExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetTokenTerms([](int type) {
+                    return type == kShiftLeftType ? Opcode::kShl : Opcode::kShr;
+                });
+            }
+        BINARYOPERATORS(ShiftExpression, 8, true, kShiftLeftType, kShiftRightType)
 
         DEFRULE(AdditiveExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 2; i < children_.size(); i += 2) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    ";
-                    switch(children_[i - 1]->GetType()) {
-                        case kPlusType:
-                            out << "    add\n";
-                            break;
-                        case kMinusType:
-                            out << "    sub\n";
-                            break;
-                    }
-                    out << '\n';
-                    scope->Pop();
-                }
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
             }
-        BEGINRULE(AdditiveExpression)
-            EXPECT(mul_expr, RULE(MultiplicativeExpression))
-            ASTERISK({
-                OR(
-                    EXPECT(op, TOKEN(Plus)),
-                    EXPECT(op, TOKEN(Minus))
-                );
-                EXPECT(mul_expr, RULE(MultiplicativeExpression));
-            });
-        ENDRULE(AdditiveExpression)
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetTokenTerms([](int type) {
+                    return type == kPlusType ? Opcode::kAdd : Opcode::kSub;
+                });
+            }
+        BINARYOPERATORS(AdditiveExpression, 9, true, kPlusType, kMinusType)
 
         DEFRULE(MultiplicativeExpression)
-            virtual void BuildProgram(vpl::Scope* scope, std::ostream& out) const override {
-                children_[0]->BuildProgram(scope, out);
-                for (size_t i = 2; i < children_.size(); i += 2) {
-                    children_[i]->BuildProgram(scope, out);
-                    out << "    ";
-                    switch(children_[i - 1]->GetType()) {
+            virtual void BuildProgram(vpl::Scope* scope, vpl::Module* out) const override {
+                BuildTerms(scope, out);
+            }
+        protected:
+            virtual Terms GetTerms() const override {
+                return GetTokenTerms([](int type) {
+                    switch (type) {
                         case kMultiplyType:
-                            out << "    mul\n";
-                            break;
+                            return Opcode::kMul;
                         case kDivideType:
-                            out << "    div\n";
-                            break;
-                        case kModuloType:
-                            out << "    mod\n";
-                            break;
+                            return Opcode::kDiv;
+                        default:
+                            return Opcode::kMod;
                     }
-                    out << '\n';
-                    scope->Pop();
-                }
+                });
             }
-        BEGINRULE(MultiplicativeExpression)
-            EXPECT(cast_expr, RULE(CastExpression));
-            ASTERISK({
-                OR3(
-                    EXPECT(op, TOKEN(Multiply)),
-                    EXPECT(op, TOKEN(Divide)),
-                    EXPECT(op, TOKEN(Modulo))
-                );
-//                EXPECT(cast_expr, RULE(CastExpression));
-                EXPECT(unary_expr, RULE(UnaryExpression));
-            });
-        ENDRULE(MultiplicativeExpression)
+        BINARYOPERATORS(MultiplicativeExpression, 10, true, kMultiplyType, kDivideType, kModuloType)
+
+        OPERAND(CastExpression)
 
     ENDRULES()
 
@@ -910,8 +1578,6 @@ DEFGRAMMAR(VPL)
     out << '[' << std::quoted(GetName()) << ", " << std::quoted(str_) << ']';   \
 }
 
-#define UNEXTENDIBLE ")([^[:alnum:]_]|$"
-
     DEFTOKENS()
         DEFTOKEN(LeftParen, "\\(")
             TOKEN_PRINT
@@ -925,7 +1591,7 @@ DEFGRAMMAR(VPL)
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(Identifier, "[[:alpha:]_][[:alnum:]_]*")
+        DEFSYMBOL(Identifier, "[[:alpha:]_][[:alnum:]_]*")
             TOKEN_PRINT
         ENDTOKEN()
 
@@ -933,7 +1599,7 @@ DEFGRAMMAR(VPL)
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(BoolConstant, "true|false")
+        DEFKEYWORD(BoolConstant, "true|false")
             TOKEN_PRINT
         ENDTOKEN()
 
@@ -1069,19 +1735,23 @@ DEFGRAMMAR(VPL)
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(StaticKeyword, "static" UNEXTENDIBLE)
+        DEFKEYWORD(StaticKeyword, "static")
+            TOKEN_PRINT
+        ENDTOKEN()
+
+        DEFKEYWORD(ExternKeyword, "extern")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(ExternKeyword, "extern" UNEXTENDIBLE)
+        DEFKEYWORD(TypedefKeyword, "typedef")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(TypedefKeyword, "typedef" UNEXTENDIBLE)
+        DEFKEYWORD(SizeofKeyword, "sizeof")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(SizeofKeyword, "sizeof" UNEXTENDIBLE)
+        DEFKEYWORD(InlineKeyword, "inline")
             TOKEN_PRINT
         ENDTOKEN()
 
@@ -1089,63 +1759,63 @@ DEFGRAMMAR(VPL)
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(VoidType, "void" UNEXTENDIBLE)
+        DEFKEYWORD(VoidType, "void")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(IntType, "int" UNEXTENDIBLE)
+        DEFKEYWORD(IntType, "int")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(BoolType, "bool" UNEXTENDIBLE)
+        DEFKEYWORD(BoolType, "bool")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(TrueKeyword, "true" UNEXTENDIBLE)
+        DEFKEYWORD(TrueKeyword, "true")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(FalseKeyword, "false" UNEXTENDIBLE)
+        DEFKEYWORD(FalseKeyword, "false")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(DoubleType, "double" UNEXTENDIBLE)
+        DEFKEYWORD(DoubleType, "double")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(StructKeyword, "struct" UNEXTENDIBLE)
+        DEFKEYWORD(StructKeyword, "struct")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(IfKeyword, "if" UNEXTENDIBLE)
+        DEFKEYWORD(IfKeyword, "if")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(ElseKeyword, "else" UNEXTENDIBLE)
+        DEFKEYWORD(ElseKeyword, "else")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(ForKeyword, "for" UNEXTENDIBLE)
+        DEFKEYWORD(ForKeyword, "for")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(WhileKeyword, "while" UNEXTENDIBLE)
+        DEFKEYWORD(WhileKeyword, "while")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(DoKeyword, "do" UNEXTENDIBLE)
+        DEFKEYWORD(DoKeyword, "do")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(ContinueKeyword, "continue" UNEXTENDIBLE)
+        DEFKEYWORD(ContinueKeyword, "continue")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(BreakKeyword, "break" UNEXTENDIBLE)
+        DEFKEYWORD(BreakKeyword, "break")
             TOKEN_PRINT
         ENDTOKEN()
 
-        DEFTOKEN(ReturnKeyword, "return" UNEXTENDIBLE)
+        DEFKEYWORD(ReturnKeyword, "return")
             TOKEN_PRINT
         ENDTOKEN()
 
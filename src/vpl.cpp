@@ -1,32 +1,202 @@
 #include <vpl_grammar.h>
+#include <vpl/asm_writer.h>
+#include <vpl/frame_lowering.h>
+#include <vpl/inliner.h>
+#include <vpl/object_writer.h>
+#include <vpl/peephole.h>
+#include <vpl/stack_verifier.h>
+#include <vpl/strength_reduction.h>
+#include <vpl/value_numbering.h>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
 
-int main(int argc, char* argv[]) {
-    std::string expression;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read-only mapping of a whole file; the parse tree and the scope refer into it */
+class MappedFile {
+public:
+    explicit MappedFile(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            Fail(path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            Fail(path);
+        }
+        size_ = info.st_size;
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                Fail(path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    std::string_view GetView() const {
+        return std::string_view(data_, size_);
+    }
+
+private:
+    [[noreturn]] static void Fail(const char* path) {
+        throw std::runtime_error(std::string("Cannot read `") + path + "`: " + std::strerror(errno));
+    }
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
 
-    if (argc > 1 && std::strcmp(argv[1], "-") != 0) {
-        std::ifstream fin(argv[1]);
-        expression.assign((std::istreambuf_iterator<char>(fin)), (std::istreambuf_iterator<char>()));
-    } else {
-        std::getline(std::cin, expression);
+/* Operand stack depth the code generator counted for each function */
+static void PrintStackDepths(const vpl::Module& module, std::ostream& out) {
+    out << std::left << std::setw(44) << "function" << std::right << std::setw(12) << "stack depth"
+        << std::setw(12) << "frame size" << '\n';
+    for (const auto& function : module.GetFunctions()) {
+        out << std::left << std::setw(44) << module.GetSymbolName(function.symbol) << std::right
+            << std::setw(12) << function.max_stack_depth << std::setw(12) << function.frame_size << '\n';
     }
-    std::cerr << "Input:\n" << expression << std::endl;
+}
 
-    std::string out_fname = argv[1];
-    out_fname += ".vasm";
-    std::ofstream asm_out(out_fname);
+int main(int argc, char* argv[]) {
+    /*
+     * --profile prints per-rule parser statistics as a table, --profile=json as JSON.
+     * --vobj writes a `.vobj` object file instead of `.vasm` text for the assembler.
+     * -O0 (or --no-opt) turns the optimizer off, -O1 inlines only functions smaller than a call and
+     * those declared `inline`, -O2 (the default) inlines larger ones too. Both compute repeated
+     * subexpressions once and replace multiplication, division and modulo by constants with cheaper
+     * shifts and masks. --opt-stats prints how many rewrites the optimizer made, which calls it
+     * inlined, and the verified operand stack depth and frame size of each function.
+     */
+    const char* profile_format = nullptr;
+    bool is_object_output = false;
+    int opt_level = 2;
+    bool print_opt_stats = false;
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (std::strncmp(argv[1], "--profile", 9) == 0) {
+            profile_format = argv[1][9] == '=' ? argv[1] + 10 : "table";
+        } else if (std::strcmp(argv[1], "--vobj") == 0) {
+            is_object_output = true;
+        } else if (std::strcmp(argv[1], "--no-opt") == 0) {
+            opt_level = 0;
+        } else if (std::strncmp(argv[1], "-O", 2) == 0 && argv[1][2] >= '0' && argv[1][2] <= '2' &&
+                   argv[1][3] == '\0') {
+            opt_level = argv[1][2] - '0';
+        } else if (std::strcmp(argv[1], "--opt-stats") == 0) {
+            print_opt_stats = true;
+        } else {
+            std::cerr << "Unknown option `" << argv[1] << '`' << std::endl;
+            return 1;
+        }
+        ++argv;
+        --argc;
+    }
 
-    VPLGrammar::Parser parser;
     try {
-        auto expr = parser.Parse(expression);
+        std::string expression;
+        std::unique_ptr<MappedFile> file;
+        std::string_view source;
+        if (argc > 1 && std::strcmp(argv[1], "-") != 0) {
+            file = std::make_unique<MappedFile>(argv[1]);
+            source = file->GetView();
+        } else {
+            std::getline(std::cin, expression);
+            source = expression;
+        }
+
+        VPLGrammar::Parser parser;
+        auto expr = parser.Parse(source);
+        if (profile_format) {
+#ifdef PARSE_PROFILE
+            if (std::strcmp(profile_format, "json") == 0) {
+                parser.GetProfile().PrintJson(std::cerr);
+            } else {
+                parser.GetProfile().PrintTable(std::cerr);
+            }
+#else
+            std::cerr << "Parser profiling is disabled, rebuild with -DVPL_PARSE_PROFILE=ON" << std::endl;
+#endif
+        }
         expr->Print(std::cout);
         std::cout << std::endl;
 
-        vpl::Scope scope(asm_out);
-        expr->BuildProgram(&scope, asm_out);
+        vpl::Resolver resolver(parser.GetSymbols());
+        expr->Resolve(&resolver);
+
+        vpl::Module module(parser.GetSymbols());
+        vpl::Scope scope(module, resolver);
+        expr->BuildProgram(&scope, &module);
+
+        if (opt_level > 0) {
+            vpl::Inliner inliner(scope.StackPointerRegister(), scope.RetRegister(), scope.FirstArgRegister(),
+                                 scope.SpareRegisterCount(), opt_level == 1 ? 12 : 48);
+            inliner.Run(&module);
+            if (print_opt_stats) {
+                inliner.PrintReport(std::cerr);
+            }
+        }
+
+        vpl::CostTable costs;
+        vpl::ValueNumbering value_numbering(costs);
+        vpl::StrengthReducer strength_reducer(costs);
+        if (opt_level > 0) {
+            value_numbering.Run(&module);
+            strength_reducer.Run(&module);
+            if (print_opt_stats) {
+                value_numbering.PrintStats(std::cerr);
+                strength_reducer.PrintStats(std::cerr);
+            }
+        }
+
+        vpl::FrameLowering frame_lowering(scope.StackPointerRegister(), scope.AssignRegister(),
+                                          scope.FirstSpareRegister(),
+                                          opt_level > 0 ? scope.SpareRegisterCount() : 0);
+        frame_lowering.Run(&module);
+
+        if (opt_level > 0) {
+            vpl::PeepholeOptimizer peephole(scope.AssignRegister());
+            peephole.Run(&module);
+            if (print_opt_stats) {
+                peephole.PrintStats(std::cerr);
+            }
+        }
+
+        vpl::StackVerifier().Run(&module);
+        if (print_opt_stats) {
+            PrintStackDepths(module, std::cerr);
+        }
+
+        /* The file is made only once the writer succeeded, so a failure leaves no partial output */
+        std::stringstream encoded;
+        std::string out_fname = argv[1];
+        if (is_object_output) {
+            vpl::ObjectWriter(module).Write(encoded);
+            std::ofstream(out_fname + ".vobj", std::ios::binary) << encoded.rdbuf();
+        } else {
+            vpl::AsmWriter(module).Write(encoded);
+            std::ofstream(out_fname + ".vasm") << encoded.rdbuf();
+        }
     } catch (std::exception& ex) {
         std::cout << ex.what();
     }